@@ -0,0 +1,469 @@
+/**
+ * @brief Host-side throughput benchmark for Nighterm.
+ *
+ * Renders a set of workloads into a malloc'd fake framebuffer at several
+ * resolutions and pixel sizes, and reports characters per second,
+ * nanoseconds per character, bytes copied to the framebuffer per
+ * character, glyph cache hit rate and peak memory.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -O2 -DNIGHTERM_MALLOC_IS_AVAILABLE -DNIGHTERM_ENABLE_STATS -I. \
+ *      bench/nighterm_bench.c nighterm.c -o nighterm_bench
+ *   ./nighterm_bench [-r WIDTHxHEIGHT] [-b BPP] [-w WORKLOAD] [-n BYTES]
+ *
+ * Every option narrows the default matrix down; WORKLOAD is one of the
+ * names printed in the first column.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nighterm.h"
+
+#ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+#error "The benchmark needs NIGHTERM_MALLOC_IS_AVAILABLE."
+#endif
+
+#ifndef NIGHTERM_ENABLE_STATS
+#error "The benchmark needs NIGHTERM_ENABLE_STATS."
+#endif
+
+/**
+ * @brief Default amount of bytes written per workload.
+ */
+#define BENCH_DEFAULT_BYTES (1u << 20)
+
+/**
+ * @brief Size of the buffers handed to nighterm_write_buffer().
+ */
+#define BENCH_CHUNK 4096
+
+/**
+ * @brief Bytes written per presented frame in deferred workloads; roughly
+ *        a 60 Hz display fed at 4 million characters per second.
+ */
+#define BENCH_FRAME 65536
+
+/**
+ * @brief Allocation header, keeps allocations 16 byte aligned.
+ */
+struct bench_header
+{
+  size_t size;
+  size_t pad;
+};
+
+static size_t bench_live_bytes;
+static size_t bench_peak_bytes;
+
+/**
+ * @brief Counting malloc() handed to Nighterm.
+ */
+static void *
+bench_malloc(size_t size)
+{
+  struct bench_header *header = malloc(sizeof(*header) + size);
+  if (header == NULL) {
+    return NULL;
+  }
+
+  header->size = size;
+  bench_live_bytes += size;
+  if (bench_live_bytes > bench_peak_bytes) {
+    bench_peak_bytes = bench_live_bytes;
+  }
+
+  return header + 1;
+}
+
+/**
+ * @brief Counting free() handed to Nighterm.
+ */
+static void
+bench_free(void *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+
+  struct bench_header *header = (struct bench_header *)ptr - 1;
+  bench_live_bytes -= header->size;
+  free(header);
+}
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+static uint64_t
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Writes a buffer in BENCH_CHUNK sized pieces.
+ */
+static void
+bench_write(struct nighterm_ctx *context, const char *buf, size_t len)
+{
+  while (len > 0) {
+    size_t chunk = len < BENCH_CHUNK ? len : BENCH_CHUNK;
+    nighterm_write_buffer(context, buf, chunk);
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+/**
+ * @brief Appends a formatted string to a text buffer.
+ */
+#define BENCH_APPEND(buf, len, cap, ...)                                      \
+  do {                                                                        \
+    int written = snprintf((buf) + (len), (cap) - (len), __VA_ARGS__);        \
+    (len) += written > 0 ? (size_t)written : 0;                               \
+    if ((len) >= (cap)) {                                                     \
+      (len) = (cap) - 1;                                                      \
+    }                                                                         \
+  } while (0)
+
+/**
+ * @brief Builds a kernel log: timestamped lines of 40-100 characters.
+ */
+static size_t
+bench_make_dmesg(char *buf, size_t cap)
+{
+  static const char *subsystems[] = { "pci", "acpi", "usb", "nvme", "e1000e",
+                                      "ext4", "sched", "mm" };
+  size_t len = 0;
+  unsigned int seed = 1;
+
+  for (unsigned int line = 0; len + 128 < cap; line++) {
+    seed = seed * 1103515245u + 12345u;
+    BENCH_APPEND(buf,
+                 len,
+                 cap,
+                 "[%5u.%06u] %s: probing device %04x:%04x, %u regions "
+                 "mapped at 0x%08x\n",
+                 line / 1000,
+                 (line * 7919u) % 1000000u,
+                 subsystems[(seed >> 16) % 8],
+                 (seed >> 8) & 0xFFFF,
+                 seed & 0xFFFF,
+                 (seed >> 4) % 7,
+                 seed);
+  }
+
+  return len;
+}
+
+/**
+ * @brief Builds the output of yes(1).
+ */
+static size_t
+bench_make_yes(char *buf, size_t cap)
+{
+  size_t len = 0;
+
+  for (; len + 2 <= cap; len += 2) {
+    buf[len] = 'y';
+    buf[len + 1] = '\n';
+  }
+
+  return len;
+}
+
+/**
+ * @brief Builds colored output: SGR sequences every few words.
+ */
+static size_t
+bench_make_ansi(char *buf, size_t cap)
+{
+  size_t len = 0;
+
+  for (unsigned int line = 0; len + 160 < cap; line++) {
+    BENCH_APPEND(buf,
+                 len,
+                 cap,
+                 "\x1b[1;3%um[ OK ]\x1b[0m Started \x1b[3%um%s %u\x1b[0m "
+                 "\x1b[38;5;%umservice\x1b[0m \x1b[48;2;0;0;%umdone\x1b[0m\n",
+                 line % 8,
+                 (line + 3) % 8,
+                 "unit",
+                 line,
+                 line % 256,
+                 line % 256);
+  }
+
+  return len;
+}
+
+/**
+ * @brief Benchmark workload.
+ */
+struct bench_workload
+{
+  const char *name;
+  size_t (*make)(char *buf, size_t cap);
+  /* 0: buffered writes, 1: nighterm_write() per byte, 2: clears,
+   * 3: buffered writes presented once per BENCH_FRAME bytes,
+   * 4: a status line redrawn with nighterm_draw_text_at() per line. */
+  int mode;
+  enum nighterm_backbuffer_mode backbuffer;
+};
+
+static const struct bench_workload bench_workloads[] = {
+  { "dmesg", bench_make_dmesg, 0, NIGHTERM_BACKBUFFER_FULL },
+  { "yes", bench_make_yes, 0, NIGHTERM_BACKBUFFER_FULL },
+  { "ansi", bench_make_ansi, 0, NIGHTERM_BACKBUFFER_FULL },
+  { "dmesg-bytewise", bench_make_dmesg, 1, NIGHTERM_BACKBUFFER_FULL },
+  { "clear", bench_make_dmesg, 2, NIGHTERM_BACKBUFFER_FULL },
+  { "dmesg-deferred", bench_make_dmesg, 3, NIGHTERM_BACKBUFFER_FULL },
+  { "dmesg-text", bench_make_dmesg, 0, NIGHTERM_BACKBUFFER_TEXT },
+  { "dmesg-direct", bench_make_dmesg, 0, NIGHTERM_BACKBUFFER_NONE },
+  { "status", bench_make_dmesg, 4, NIGHTERM_BACKBUFFER_FULL },
+};
+
+/**
+ * @brief Benchmark resolution.
+ */
+struct bench_mode
+{
+  uint64_t width;
+  uint64_t height;
+};
+
+static const struct bench_mode bench_modes[] = {
+  { 800, 600 },
+  { 1920, 1080 },
+  { 3840, 2160 },
+};
+
+static const uint16_t bench_bpps[] = { 32, 24, 16 };
+
+/**
+ * @brief Runs a single workload at a single mode and prints the result.
+ *
+ * @return 0 on success, -1 if Nighterm failed to initialize.
+ */
+static int
+bench_run(const struct bench_workload *workload,
+          const struct bench_mode *mode,
+          uint16_t bpp,
+          const char *text,
+          size_t len)
+{
+  size_t fb_size = mode->width * mode->height * ((bpp + 7) / 8);
+  void *framebuffer = calloc(1, fb_size);
+  struct nighterm_ctx *context = calloc(1, sizeof(*context));
+
+  if (framebuffer == NULL || context == NULL) {
+    free(framebuffer);
+    free(context);
+    return -1;
+  }
+
+  bench_live_bytes = 0;
+  bench_peak_bytes = 0;
+
+  struct nighterm_hooks hooks = { 0 };
+  hooks.backbuffer_mode = workload->backbuffer;
+
+  int status = nighterm_initialize(context,
+                                   NULL,
+                                   0,
+                                   framebuffer,
+                                   mode->width,
+                                   mode->height,
+                                   bpp,
+                                   bench_malloc,
+                                   bench_free,
+                                   &hooks);
+  if (status != NIGHTERM_SUCCESS) {
+    fprintf(stderr, "nighterm_initialize: %d\n", status);
+    free(framebuffer);
+    free(context);
+    return -1;
+  }
+
+  nighterm_reset_stats(context);
+  uint64_t start = bench_now();
+
+  if (workload->mode == 0) {
+    bench_write(context, text, len);
+  } else if (workload->mode == 3) {
+    nighterm_set_present_mode(context, NIGHTERM_PRESENT_DEFERRED, 0);
+    for (size_t done = 0; done < len; done += BENCH_FRAME) {
+      bench_write(context,
+                  text + done,
+                  len - done < BENCH_FRAME ? len - done : BENCH_FRAME);
+      nighterm_present(context);
+    }
+  } else if (workload->mode == 4) {
+    /* Every line of text redraws a status line holding a counter, so most
+     * of its cells are unchanged between updates. */
+    struct nighterm_attr attr = { 0, 7, 0 };
+    char status[64];
+    for (size_t done = 0; done < len; done++) {
+      if (text[done] != '\n') {
+        continue;
+      }
+      int status_len =
+        snprintf(status, sizeof(status), " uptime %8zu  load 0.42 ", done);
+      nighterm_draw_text_at(context, 0, 0, status, (size_t)status_len, &attr);
+    }
+  } else if (workload->mode == 1) {
+    for (size_t i = 0; i < len; i++) {
+      nighterm_write(context, text[i]);
+    }
+  } else {
+    /* A clear followed by one line, the pattern of a redrawing UI. */
+    size_t line = 0;
+    for (size_t done = 0; done < len; done = line) {
+      size_t end = line;
+      while (end < len && text[end] != '\n') {
+        end++;
+      }
+      nighterm_flush(context, 0, 0, (uint8_t)done);
+      nighterm_write_buffer(context, text + line, end - line);
+      line = end + 1;
+    }
+  }
+
+  uint64_t elapsed = bench_now() - start;
+  struct nighterm_stats stats;
+  nighterm_get_stats(context, &stats);
+
+  uint64_t lookups = stats.glyph_cache_hits + stats.glyph_cache_misses;
+  double ns_per_char = (double)elapsed / (double)len;
+  printf("%-15s %4llux%-4llu %2u %12.0f %9.2f %12.1f %6.1f %9.1f\n",
+         workload->name,
+         (unsigned long long)mode->width,
+         (unsigned long long)mode->height,
+         bpp,
+         1e9 / ns_per_char,
+         ns_per_char,
+         (double)stats.vram_bytes / (double)len,
+         lookups ? 100.0 * (double)stats.glyph_cache_hits / (double)lookups
+                 : 100.0,
+         (double)(bench_peak_bytes + sizeof(*context)) / (1024.0 * 1024.0));
+
+  nighterm_shutdown(context);
+  free(context);
+  free(framebuffer);
+
+  return 0;
+}
+
+/**
+ * @brief Prints usage information.
+ */
+static void
+bench_usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-r WIDTHxHEIGHT] [-b BPP] [-w WORKLOAD] [-n BYTES]\n",
+          argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_mode only_mode = { 0, 0 };
+  uint16_t only_bpp = 0;
+  const char *only_workload = NULL;
+  size_t bytes = BENCH_DEFAULT_BYTES;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      bench_usage(argv[0]);
+      return 1;
+    }
+
+    if (strcmp(argv[i], "-r") == 0) {
+      unsigned long long width, height;
+      if (sscanf(argv[++i], "%llux%llu", &width, &height) != 2) {
+        bench_usage(argv[0]);
+        return 1;
+      }
+      only_mode.width = width;
+      only_mode.height = height;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      only_bpp = (uint16_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0) {
+      only_workload = argv[++i];
+    } else if (strcmp(argv[i], "-n") == 0) {
+      bytes = (size_t)strtoull(argv[++i], NULL, 0);
+    } else {
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  char *text = malloc(bytes + 1);
+  if (text == NULL || bytes < 256) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  printf("%-15s %9s %2s %12s %9s %12s %6s %9s\n",
+         "workload",
+         "mode",
+         "bpp",
+         "chars/s",
+         "ns/char",
+         "flush B/char",
+         "hit %",
+         "peak MiB");
+
+  for (size_t w = 0; w < sizeof(bench_workloads) / sizeof(bench_workloads[0]);
+       w++) {
+    const struct bench_workload *workload = &bench_workloads[w];
+    if (only_workload != NULL && strcmp(only_workload, workload->name) != 0) {
+      continue;
+    }
+
+    size_t len = workload->make(text, bytes + 1);
+
+    /* Per-byte writes flush per byte and clears rewrite the whole screen
+     * per line; keep those short. */
+    if (workload->mode == 1 && len > bytes / 16) {
+      len = bytes / 16;
+    } else if (workload->mode == 2 && len > bytes / 1024) {
+      len = bytes / 1024;
+    }
+
+    size_t mode_count = sizeof(bench_modes) / sizeof(bench_modes[0]);
+    const struct bench_mode *modes = bench_modes;
+    if (only_mode.width != 0) {
+      modes = &only_mode;
+      mode_count = 1;
+    }
+
+    for (size_t m = 0; m < mode_count; m++) {
+      for (size_t b = 0; b < sizeof(bench_bpps) / sizeof(bench_bpps[0]); b++) {
+        uint16_t bpp = only_bpp != 0 ? only_bpp : bench_bpps[b];
+        if (bench_run(workload, &modes[m], bpp, text, len) != 0) {
+          free(text);
+          return 1;
+        }
+        if (only_bpp != 0) {
+          break;
+        }
+      }
+    }
+  }
+
+  free(text);
+
+  return 0;
+}
@@ -5,42 +5,5682 @@
 #include "nighterm.h"
 #include "nighterm_font.h"
 
+/*
+ * Performance counters.
+ *
+ * Compiled out unless NIGHTERM_ENABLE_STATS is defined. A stage is timed
+ * by NIGHTERM_STAT_START() and NIGHTERM_STAT_STOP() in the same scope.
+ */
+#ifdef NIGHTERM_ENABLE_STATS
+#define NIGHTERM_STAT_ADD(context, counter, n) ((context)->stats.counter += (n))
+#define NIGHTERM_STAT_START(context)                                          \
+  uint64_t nighterm_stat_start = nighterm_clock(context)
+#define NIGHTERM_STAT_STOP(context, counter)                                  \
+  ((context)->stats.counter += nighterm_clock(context) - nighterm_stat_start)
+#else
+#define NIGHTERM_STAT_ADD(context, counter, n) ((void)0)
+#define NIGHTERM_STAT_START(context) ((void)0)
+#define NIGHTERM_STAT_STOP(context, counter) ((void)0)
+#endif
+
+/*
+ * Copy kernels.
+ *
+ * The widest available implementation is picked at compile time:
+ * AVX2, SSE2 or a portable 64-bit one. Define NIGHTERM_NO_SIMD to force
+ * the portable implementation, e.g. for kernels built with -mno-sse that
+ * still define the feature macros.
+ */
+#if !defined(NIGHTERM_NO_SIMD) && defined(__AVX2__)
+#define NIGHTERM_SIMD_AVX2
+#include <immintrin.h>
+#elif !defined(NIGHTERM_NO_SIMD) && defined(__SSE2__)
+#define NIGHTERM_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * @private
+ * @brief Unaligned, aliasing-safe 64-bit word.
+ */
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) nighterm_word;
+
+/**
+ * @private
+ * @brief Unaligned, aliasing-safe 32-bit word.
+ */
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) nighterm_dword;
+
+/**
+ * @private
+ * @brief Copies n bytes of memory to destination using the widest
+ *        available stores.
+ *
+ * @param          dest
+ *                 Pointer to destination memory
+ *
+ * @param          src
+ *                 Pointer to source memory
+ *
+ * @param          n
+ *                 Amount of bytes to copy
+ */
+void
+nighterm_memcpy(void *dest, const void *src, size_t n)
+{
+  const uint8_t *psrc = (const uint8_t *)src;
+  uint8_t *pdest = (uint8_t *)dest;
+
+  /* Align the destination, so that stores never straddle a word. */
+  while (n > 0 && ((uintptr_t)pdest & 7) != 0) {
+    *pdest++ = *psrc++;
+    n--;
+  }
+
+#if defined(NIGHTERM_SIMD_AVX2)
+  for (; n >= 64; n -= 64, psrc += 64, pdest += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)psrc);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(psrc + 32));
+    _mm256_storeu_si256((__m256i *)pdest, a);
+    _mm256_storeu_si256((__m256i *)(pdest + 32), b);
+  }
+#elif defined(NIGHTERM_SIMD_SSE2)
+  for (; n >= 64; n -= 64, psrc += 64, pdest += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)psrc);
+    __m128i b = _mm_loadu_si128((const __m128i *)(psrc + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(psrc + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(psrc + 48));
+    _mm_storeu_si128((__m128i *)pdest, a);
+    _mm_storeu_si128((__m128i *)(pdest + 16), b);
+    _mm_storeu_si128((__m128i *)(pdest + 32), c);
+    _mm_storeu_si128((__m128i *)(pdest + 48), d);
+  }
+#endif
+
+  for (; n >= 8; n -= 8, psrc += 8, pdest += 8) {
+    *(nighterm_word *)pdest = *(const nighterm_word *)psrc;
+  }
+
+  while (n > 0) {
+    *pdest++ = *psrc++;
+    n--;
+  }
+}
+
+/**
+ * @private
+ * @brief Copies n bytes of memory to the framebuffer.
+ *
+ * Uses non-temporal (streaming) stores where available, so that copies
+ * bypass the cache and fill write-combining buffers with whole lines.
+ * nighterm_vram_fence() must be called after the last copy of a flush.
+ *
+ * @param          dest
+ *                 Pointer to framebuffer memory
+ *
+ * @param          src
+ *                 Pointer to source memory
+ *
+ * @param          n
+ *                 Amount of bytes to copy
+ */
+void
+nighterm_memcpy_vram(void *dest, const void *src, size_t n)
+{
+#if defined(NIGHTERM_SIMD_AVX2) || defined(NIGHTERM_SIMD_SSE2)
+  const uint8_t *psrc = (const uint8_t *)src;
+  uint8_t *pdest = (uint8_t *)dest;
+
+  if (n < 64) {
+    nighterm_memcpy(dest, src, n);
+    return;
+  }
+
+#if defined(NIGHTERM_SIMD_AVX2)
+  size_t head = (32 - ((uintptr_t)pdest & 31)) & 31;
+#else
+  size_t head = (16 - ((uintptr_t)pdest & 15)) & 15;
+#endif
+  nighterm_memcpy(pdest, psrc, head);
+  psrc += head;
+  pdest += head;
+  n -= head;
+
+#if defined(NIGHTERM_SIMD_AVX2)
+  for (; n >= 64; n -= 64, psrc += 64, pdest += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)psrc);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(psrc + 32));
+    _mm256_stream_si256((__m256i *)pdest, a);
+    _mm256_stream_si256((__m256i *)(pdest + 32), b);
+  }
+#else
+  for (; n >= 64; n -= 64, psrc += 64, pdest += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)psrc);
+    __m128i b = _mm_loadu_si128((const __m128i *)(psrc + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(psrc + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(psrc + 48));
+    _mm_stream_si128((__m128i *)pdest, a);
+    _mm_stream_si128((__m128i *)(pdest + 16), b);
+    _mm_stream_si128((__m128i *)(pdest + 32), c);
+    _mm_stream_si128((__m128i *)(pdest + 48), d);
+  }
+#endif
+
+  nighterm_memcpy(pdest, psrc, n);
+#else
+  nighterm_memcpy(dest, src, n);
+#endif
+}
+
+/**
+ * @private
+ * @brief Orders all previous non-temporal framebuffer stores before any
+ *        later store.
+ */
+void
+nighterm_vram_fence(void)
+{
+#if defined(NIGHTERM_SIMD_AVX2) || defined(NIGHTERM_SIMD_SSE2)
+  _mm_sfence();
+#endif
+}
+
+#ifdef NIGHTERM_ENABLE_STATS
+/**
+ * @private
+ * @brief Reads the clock used to time stages.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @return         The host clock if set, the time stamp counter on x86;
+ *                 0 otherwise.
+ */
+uint64_t
+nighterm_clock(struct nighterm_ctx *context)
+{
+  if (context->hooks.clock != NULL) {
+    return context->hooks.clock(context->hooks.user);
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+#endif
+
+/**
+ * @private
+ * @brief Fills memory with count copies of a 32-bit value using the
+ *        widest available stores.
+ *
+ * @param          dest
+ *                 Pointer to destination memory, aligned to 4 bytes
+ *
+ * @param          value
+ *                 Value to store
+ *
+ * @param          count
+ *                 Amount of 32-bit values to store
+ */
+void
+nighterm_memset32(void *dest, uint32_t value, size_t count)
+{
+  uint32_t *pdest = (uint32_t *)dest;
+
+  if (count > 0 && ((uintptr_t)pdest & 7) != 0) {
+    *pdest++ = value;
+    count--;
+  }
+
+#if defined(NIGHTERM_SIMD_AVX2)
+  __m256i wide = _mm256_set1_epi32((int)value);
+  for (; count >= 16; count -= 16, pdest += 16) {
+    _mm256_storeu_si256((__m256i *)pdest, wide);
+    _mm256_storeu_si256((__m256i *)(pdest + 8), wide);
+  }
+#elif defined(NIGHTERM_SIMD_SSE2)
+  __m128i wide = _mm_set1_epi32((int)value);
+  for (; count >= 16; count -= 16, pdest += 16) {
+    _mm_storeu_si128((__m128i *)pdest, wide);
+    _mm_storeu_si128((__m128i *)(pdest + 4), wide);
+    _mm_storeu_si128((__m128i *)(pdest + 8), wide);
+    _mm_storeu_si128((__m128i *)(pdest + 12), wide);
+  }
+#endif
+
+  uint64_t pair = ((uint64_t)value << 32) | value;
+  for (; count >= 2; count -= 2, pdest += 2) {
+    *(nighterm_word *)pdest = pair;
+  }
+
+  if (count > 0) {
+    *pdest = value;
+  }
+}
+
+/**
+ * @private
+ * @brief Measures the run of printable ASCII (0x20-0x7E) at the start of
+ *        a buffer, 16 or 8 bytes at a time.
+ *
+ * @param          buf
+ *                 Pointer to the characters
+ *
+ * @param          len
+ *                 Amount of characters in buf
+ *
+ * @return         Length of the run.
+ */
+size_t
+nighterm_ascii_run(const char *buf, size_t len)
+{
+  size_t run = 0;
+
+#if defined(NIGHTERM_SIMD_AVX2) || defined(NIGHTERM_SIMD_SSE2)
+  /* Signed compares: bytes above 0x7F are negative and fail the first. */
+  const __m128i low = _mm_set1_epi8(0x1F);
+  const __m128i high = _mm_set1_epi8(0x7F);
+  for (; run + 16 <= len; run += 16) {
+    __m128i chars = _mm_loadu_si128((const __m128i *)(buf + run));
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(chars, low),
+                                      _mm_cmplt_epi8(chars, high));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(printable);
+    if (mask != 0xFFFF) {
+      return run + (size_t)__builtin_ctz(~mask);
+    }
+  }
+#endif
+
+  const uint64_t ones = 0x0101010101010101ull;
+  const uint64_t highs = 0x8080808080808080ull;
+  for (; run + 8 <= len; run += 8) {
+    uint64_t word = *(const nighterm_word *)(buf + run);
+    /* With the high bits clear, adding 1 only carries out of 0x7F, and
+     * subtracting 0x20 from the bytes with the high bit forced on only
+     * clears it below 0x20; neither borrows across bytes. */
+    uint64_t bad = (word | (word + ones) | ~((word | highs) - ones * 0x20)) &
+                   highs;
+    if (bad != 0) {
+      break;
+    }
+  }
+
+  while (run < len && (uint8_t)(buf[run] - 0x20) < 0x5F) {
+    run++;
+  }
+
+  return run;
+}
+
+/*
+ * Blitters.
+ *
+ * One set of span fillers and glyph row expanders is generated per pixel
+ * size; nighterm_setup_format() picks the set once, so the inner loops
+ * never branch on the pixel format.
+ */
+#define NIGHTERM_STORE_8(dest, value) (*(dest) = (uint8_t)(value))
+#define NIGHTERM_STORE_16(dest, value) (*(uint16_t *)(dest) = (uint16_t)(value))
+#define NIGHTERM_STORE_24(dest, value)                                        \
+  do {                                                                        \
+    (dest)[0] = (uint8_t)(value);                                             \
+    (dest)[1] = (uint8_t)((value) >> 8);                                      \
+    (dest)[2] = (uint8_t)((value) >> 16);                                     \
+  } while (0)
+#define NIGHTERM_STORE_32(dest, value) (*(uint32_t *)(dest) = (value))
+
+/*
+ * Glyph rows are expanded eight pixels per bitmap byte. The mask table
+ * turns a byte into eight byte lanes, 0xFF for set pixels and 0x00 for
+ * clear ones, leftmost pixel in the lowest lane; the expanders widen the
+ * lanes to the pixel size (a sign extension of each lane in the scalar
+ * paths) and select bg ^ ((fg ^ bg) & mask) without a branch. A last
+ * partial byte goes pixel by pixel. Like the rest of the blitters this
+ * assumes a little-endian framebuffer.
+ */
+#define NIGHTERM_MASK_LANE(b, lane)                                           \
+  ((uint64_t)(((b) >> (7 - (lane))) & 1) * 0xFFu << (8 * (lane)))
+#define NIGHTERM_MASK(b)                                                      \
+  (NIGHTERM_MASK_LANE(b, 0) | NIGHTERM_MASK_LANE(b, 1) |                      \
+   NIGHTERM_MASK_LANE(b, 2) | NIGHTERM_MASK_LANE(b, 3) |                      \
+   NIGHTERM_MASK_LANE(b, 4) | NIGHTERM_MASK_LANE(b, 5) |                      \
+   NIGHTERM_MASK_LANE(b, 6) | NIGHTERM_MASK_LANE(b, 7)),
+#define NIGHTERM_MASKS_4(b)                                                   \
+  NIGHTERM_MASK(b) NIGHTERM_MASK((b) + 1) NIGHTERM_MASK((b) + 2)              \
+    NIGHTERM_MASK((b) + 3)
+#define NIGHTERM_MASKS_16(b)                                                  \
+  NIGHTERM_MASKS_4(b) NIGHTERM_MASKS_4((b) + 4) NIGHTERM_MASKS_4((b) + 8)     \
+    NIGHTERM_MASKS_4((b) + 12)
+#define NIGHTERM_MASKS_64(b)                                                  \
+  NIGHTERM_MASKS_16(b) NIGHTERM_MASKS_16((b) + 16)                            \
+    NIGHTERM_MASKS_16((b) + 32) NIGHTERM_MASKS_16((b) + 48)
+
+static const uint64_t nighterm_glyph_masks[256] __attribute__((aligned(64))) = {
+  NIGHTERM_MASKS_64(0) NIGHTERM_MASKS_64(64) NIGHTERM_MASKS_64(128)
+    NIGHTERM_MASKS_64(192)
+};
+
+/**
+ * @private
+ * @brief Returns 0xFFFFFFFF if a pixel of a glyph row is set, 0 otherwise.
+ */
+#define NIGHTERM_GLYPH_BIT(bitmap, x)                                         \
+  ((uint32_t)0 - (((bitmap)[(x) >> 3] >> (7 - ((x) & 7))) & 1))
+
+/**
+ * @private
+ * @brief Expands one row of a glyph bitmap into 32bpp pixels.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          bitmap
+ *                 Row of the glyph bitmap, most significant bit first
+ *
+ * @param          width
+ *                 Amount of pixels
+ *
+ * @param          fg
+ *                 Packed color of set pixels
+ *
+ * @param          bg
+ *                 Packed color of clear pixels
+ */
+void
+nighterm_glyph_span_32(uint8_t *dest,
+                       const uint8_t *bitmap,
+                       uint32_t width,
+                       uint32_t fg,
+                       uint32_t bg)
+{
+  uint32_t diff = fg ^ bg;
+  uint32_t x = 0;
+
+#if defined(NIGHTERM_SIMD_AVX2)
+  const __m256i wide_diff = _mm256_set1_epi32((int)diff);
+  const __m256i wide_bg = _mm256_set1_epi32((int)bg);
+  for (; x + 8 <= width; x += 8, dest += 32) {
+    __m256i mask = _mm256_cvtepi8_epi32(
+      _mm_loadl_epi64((const __m128i *)&nighterm_glyph_masks[bitmap[x >> 3]]));
+    _mm256_storeu_si256(
+      (__m256i *)dest,
+      _mm256_xor_si256(wide_bg, _mm256_and_si256(wide_diff, mask)));
+  }
+#elif defined(NIGHTERM_SIMD_SSE2)
+  const __m128i wide_diff = _mm_set1_epi32((int)diff);
+  const __m128i wide_bg = _mm_set1_epi32((int)bg);
+  for (; x + 8 <= width; x += 8, dest += 32) {
+    __m128i bytes =
+      _mm_loadl_epi64((const __m128i *)&nighterm_glyph_masks[bitmap[x >> 3]]);
+    __m128i words = _mm_unpacklo_epi8(bytes, bytes);
+    __m128i low = _mm_unpacklo_epi16(words, words);
+    __m128i high = _mm_unpackhi_epi16(words, words);
+    _mm_storeu_si128((__m128i *)dest,
+                     _mm_xor_si128(wide_bg, _mm_and_si128(wide_diff, low)));
+    _mm_storeu_si128((__m128i *)(dest + 16),
+                     _mm_xor_si128(wide_bg, _mm_and_si128(wide_diff, high)));
+  }
+#else
+  for (; x + 8 <= width; x += 8) {
+    uint64_t mask = nighterm_glyph_masks[bitmap[x >> 3]];
+    for (uint32_t lane = 0; lane < 8; lane++, dest += 4) {
+      *(nighterm_dword *)dest =
+        bg ^ (diff & (uint32_t)(int32_t)(int8_t)(mask >> (8 * lane)));
+    }
+  }
+#endif
+
+  for (; x < width; x++, dest += 4) {
+    *(nighterm_dword *)dest = bg ^ (diff & NIGHTERM_GLYPH_BIT(bitmap, x));
+  }
+}
+
+/**
+ * @private
+ * @brief Expands one row of a glyph bitmap into 24bpp pixels. Each pixel
+ *        is a 32-bit store that the next one overlaps.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          bitmap
+ *                 Row of the glyph bitmap, most significant bit first
+ *
+ * @param          width
+ *                 Amount of pixels
+ *
+ * @param          fg
+ *                 Packed color of set pixels
+ *
+ * @param          bg
+ *                 Packed color of clear pixels
+ */
+void
+nighterm_glyph_span_24(uint8_t *dest,
+                       const uint8_t *bitmap,
+                       uint32_t width,
+                       uint32_t fg,
+                       uint32_t bg)
+{
+  uint32_t diff = fg ^ bg;
+  uint32_t x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    uint64_t mask = nighterm_glyph_masks[bitmap[x >> 3]];
+    for (uint32_t lane = 0; lane < 7; lane++, dest += 3) {
+      *(nighterm_dword *)dest =
+        bg ^ (diff & (uint32_t)(int32_t)(int8_t)(mask >> (8 * lane)));
+    }
+    NIGHTERM_STORE_24(dest,
+                      bg ^ (diff & (uint32_t)(int32_t)(int8_t)(mask >> 56)));
+    dest += 3;
+  }
+
+  for (; x < width; x++, dest += 3) {
+    NIGHTERM_STORE_24(dest, bg ^ (diff & NIGHTERM_GLYPH_BIT(bitmap, x)));
+  }
+}
+
+/**
+ * @private
+ * @brief Expands one row of a glyph bitmap into 16bpp pixels.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          bitmap
+ *                 Row of the glyph bitmap, most significant bit first
+ *
+ * @param          width
+ *                 Amount of pixels
+ *
+ * @param          fg
+ *                 Packed color of set pixels
+ *
+ * @param          bg
+ *                 Packed color of clear pixels
+ */
+void
+nighterm_glyph_span_16(uint8_t *dest,
+                       const uint8_t *bitmap,
+                       uint32_t width,
+                       uint32_t fg,
+                       uint32_t bg)
+{
+  uint32_t diff = fg ^ bg;
+  uint32_t x = 0;
+
+#if defined(NIGHTERM_SIMD_AVX2) || defined(NIGHTERM_SIMD_SSE2)
+  const __m128i wide_diff = _mm_set1_epi16((short)diff);
+  const __m128i wide_bg = _mm_set1_epi16((short)bg);
+  for (; x + 8 <= width; x += 8, dest += 16) {
+    __m128i bytes =
+      _mm_loadl_epi64((const __m128i *)&nighterm_glyph_masks[bitmap[x >> 3]]);
+    __m128i mask = _mm_unpacklo_epi8(bytes, bytes);
+    _mm_storeu_si128((__m128i *)dest,
+                     _mm_xor_si128(wide_bg, _mm_and_si128(wide_diff, mask)));
+  }
+#else
+  /* Two pixels per 32-bit lane pair. */
+  uint64_t wide_diff = (diff & 0xFFFF) * 0x0001000100010001ull;
+  uint64_t wide_bg = (bg & 0xFFFF) * 0x0001000100010001ull;
+  for (; x + 8 <= width; x += 8, dest += 16) {
+    uint64_t mask = nighterm_glyph_masks[bitmap[x >> 3]];
+    uint64_t low = (mask & 0xFF) | (mask & 0xFF00) << 8 |
+                   (mask & 0xFF0000) << 16 | (mask & 0xFF000000) << 24;
+    uint64_t high = (mask >> 32 & 0xFF) | (mask >> 32 & 0xFF00) << 8 |
+                    (mask >> 32 & 0xFF0000) << 16 |
+                    (mask >> 32 & 0xFF000000) << 24;
+    *(nighterm_word *)dest = wide_bg ^ (wide_diff & (low * 0x0101));
+    *(nighterm_word *)(dest + 8) = wide_bg ^ (wide_diff & (high * 0x0101));
+  }
+#endif
+
+  for (; x < width; x++, dest += 2) {
+    NIGHTERM_STORE_16(dest, bg ^ (diff & NIGHTERM_GLYPH_BIT(bitmap, x)));
+  }
+}
+
+/**
+ * @private
+ * @brief Expands one row of a glyph bitmap into 8bpp pixels, eight pixels
+ *        per 64-bit store.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          bitmap
+ *                 Row of the glyph bitmap, most significant bit first
+ *
+ * @param          width
+ *                 Amount of pixels
+ *
+ * @param          fg
+ *                 Packed color of set pixels
+ *
+ * @param          bg
+ *                 Packed color of clear pixels
+ */
+void
+nighterm_glyph_span_8(uint8_t *dest,
+                      const uint8_t *bitmap,
+                      uint32_t width,
+                      uint32_t fg,
+                      uint32_t bg)
+{
+  uint32_t diff = fg ^ bg;
+  uint64_t wide_diff = (diff & 0xFF) * 0x0101010101010101ull;
+  uint64_t wide_bg = (bg & 0xFF) * 0x0101010101010101ull;
+  uint32_t x = 0;
+
+  for (; x + 8 <= width; x += 8, dest += 8) {
+    *(nighterm_word *)dest =
+      wide_bg ^ (wide_diff & nighterm_glyph_masks[bitmap[x >> 3]]);
+  }
+
+  for (; x < width; x++, dest++) {
+    NIGHTERM_STORE_8(dest, bg ^ (diff & NIGHTERM_GLYPH_BIT(bitmap, x)));
+  }
+}
+
+/**
+ * @private
+ * @brief Fills a span of 32bpp pixels.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          color
+ *                 Packed color
+ *
+ * @param          count
+ *                 Amount of pixels
+ */
+void
+nighterm_fill_span_32(uint8_t *dest, uint32_t color, uint64_t count)
+{
+  nighterm_memset32(dest, color, count);
+}
+
+/**
+ * @private
+ * @brief Fills a span of 16bpp pixels, two pixels per 32-bit store.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          color
+ *                 Packed color
+ *
+ * @param          count
+ *                 Amount of pixels
+ */
+void
+nighterm_fill_span_16(uint8_t *dest, uint32_t color, uint64_t count)
+{
+  if (count > 0 && ((uintptr_t)dest & 3) != 0) {
+    NIGHTERM_STORE_16(dest, color);
+    dest += 2;
+    count--;
+  }
+
+  nighterm_memset32(dest, (color & 0xFFFF) * 0x00010001u, count >> 1);
+
+  if (count & 1) {
+    NIGHTERM_STORE_16(dest + (count - 1) * 2, color);
+  }
+}
+
+/**
+ * @private
+ * @brief Fills a span of 24bpp pixels by storing one pixel and doubling it.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          color
+ *                 Packed color
+ *
+ * @param          count
+ *                 Amount of pixels
+ */
+void
+nighterm_fill_span_24(uint8_t *dest, uint32_t color, uint64_t count)
+{
+  uint64_t length = count * 3;
+
+  if (count == 0) {
+    return;
+  }
+
+  NIGHTERM_STORE_24(dest, color);
+  for (uint64_t done = 3; done < length;) {
+    uint64_t chunk = done < length - done ? done : length - done;
+    nighterm_memcpy(dest + done, dest, chunk);
+    done += chunk;
+  }
+}
+
+/**
+ * @private
+ * @brief Fills a span of 8bpp pixels.
+ *
+ * @param          dest
+ *                 Pointer to the first pixel
+ *
+ * @param          color
+ *                 Packed color
+ *
+ * @param          count
+ *                 Amount of pixels
+ */
+void
+nighterm_fill_span_8(uint8_t *dest, uint32_t color, uint64_t count)
+{
+  for (; count > 0 && ((uintptr_t)dest & 3) != 0; count--) {
+    NIGHTERM_STORE_8(dest++, color);
+  }
+
+  nighterm_memset32(dest, (color & 0xFF) * 0x01010101u, count >> 2);
+  dest += count & ~(uint64_t)3;
+
+  for (count &= 3; count > 0; count--) {
+    NIGHTERM_STORE_8(dest++, color);
+  }
+}
+
+/**
+ * @private
+ * @brief Sets the pixel layout and selects the blitters for it.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @return         NIGHTERM_SUCCESS if the pixel size is supported;
+ *                 NIGHTERM_INVALID_PARAMETER otherwise.
+ */
+int
+nighterm_setup_format(struct nighterm_ctx *context,
+                      uint8_t red_size,
+                      uint8_t red_shift,
+                      uint8_t green_size,
+                      uint8_t green_shift,
+                      uint8_t blue_size,
+                      uint8_t blue_shift)
+{
+  switch (context->fb_bytes_per_pixel) {
+    case 4:
+      context->fill_span = nighterm_fill_span_32;
+      context->glyph_span = nighterm_glyph_span_32;
+      break;
+    case 3:
+      context->fill_span = nighterm_fill_span_24;
+      context->glyph_span = nighterm_glyph_span_24;
+      break;
+    case 2:
+      context->fill_span = nighterm_fill_span_16;
+      context->glyph_span = nighterm_glyph_span_16;
+      break;
+    case 1:
+      context->fill_span = nighterm_fill_span_8;
+      context->glyph_span = nighterm_glyph_span_8;
+      break;
+    default:
+      return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  uint32_t bits = (uint32_t)context->fb_bytes_per_pixel * 8;
+  if (red_size > 8 || green_size > 8 || blue_size > 8 ||
+      red_shift + red_size > bits || green_shift + green_size > bits ||
+      blue_shift + blue_size > bits) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  context->red_size = red_size;
+  context->red_shift = red_shift;
+  context->green_size = green_size;
+  context->green_shift = green_shift;
+  context->blue_size = blue_size;
+  context->blue_shift = blue_shift;
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @private
+ * @brief Packs a color into the framebuffer's pixel format.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          r
+ *                 Red color value (0-255)
+ *
+ * @param          g
+ *                 Green color value (0-255)
+ *
+ * @param          b
+ *                 Blue color value (0-255)
+ *
+ * @return         Packed pixel value
+ */
+uint32_t
+nighterm_pack_color(struct nighterm_ctx *context,
+                    uint8_t r,
+                    uint8_t g,
+                    uint8_t b)
+{
+  return ((uint32_t)(r >> (8 - context->red_size)) << context->red_shift) |
+         ((uint32_t)(g >> (8 - context->green_size)) << context->green_shift) |
+         ((uint32_t)(b >> (8 - context->blue_size)) << context->blue_shift);
+}
+
+/**
+ * @private
+ * @brief Extracts a color component from a packed pixel value, scaled
+ *        back to 0-255.
+ *
+ * @param          value
+ *                 Packed pixel value
+ *
+ * @param          size
+ *                 Size of the component in bits
+ *
+ * @param          shift
+ *                 Position of the component
+ *
+ * @return         Color value (0-255)
+ */
+uint8_t
+nighterm_unpack_component(uint32_t value, uint8_t size, uint8_t shift)
+{
+  if (size == 0) {
+    return 0;
+  }
+
+  uint32_t component = (value >> shift) & ((1u << size) - 1);
+
+  /* Replicate the high bits into the low ones, so that full scale maps to
+   * 255. */
+  uint32_t scaled = component << (8 - size);
+  for (uint8_t filled = size; filled < 8; filled += size) {
+    scaled |= scaled >> size;
+  }
+
+  return (uint8_t)scaled;
+}
+
+/**
+ * @private
+ * @brief The 16 standard ANSI colors, as used by the Linux console.
+ */
+static const uint8_t nighterm_ansi_colors[16][3] = {
+  { 0x00, 0x00, 0x00 }, { 0xAA, 0x00, 0x00 }, { 0x00, 0xAA, 0x00 },
+  { 0xAA, 0x55, 0x00 }, { 0x00, 0x00, 0xAA }, { 0xAA, 0x00, 0xAA },
+  { 0x00, 0xAA, 0xAA }, { 0xAA, 0xAA, 0xAA }, { 0x55, 0x55, 0x55 },
+  { 0xFF, 0x55, 0x55 }, { 0x55, 0xFF, 0x55 }, { 0xFF, 0xFF, 0x55 },
+  { 0x55, 0x55, 0xFF }, { 0xFF, 0x55, 0xFF }, { 0x55, 0xFF, 0xFF },
+  { 0xFF, 0xFF, 0xFF },
+};
+
+/**
+ * @private
+ * @brief Component levels of the 6x6x6 color cube of the 256 color
+ *        palette.
+ */
+static const uint8_t nighterm_cube_levels[6] = { 0x00, 0x5F, 0x87,
+                                                 0xAF, 0xD7, 0xFF };
+
+/**
+ * @private
+ * @brief Packs the indexed colors into the framebuffer's pixel format.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_build_palette(struct nighterm_ctx *context)
+{
+  for (uint32_t i = 0; i < 16; i++) {
+    context->palette[i] = nighterm_pack_color(context,
+                                              nighterm_ansi_colors[i][0],
+                                              nighterm_ansi_colors[i][1],
+                                              nighterm_ansi_colors[i][2]);
+  }
+
+  for (uint32_t i = 0; i < 216; i++) {
+    context->palette[16 + i] =
+      nighterm_pack_color(context,
+                          nighterm_cube_levels[i / 36],
+                          nighterm_cube_levels[i / 6 % 6],
+                          nighterm_cube_levels[i % 6]);
+  }
+
+  for (uint32_t i = 0; i < 24; i++) {
+    uint8_t level = (uint8_t)(8 + 10 * i);
+    context->palette[232 + i] = nighterm_pack_color(context, level, level, level);
+  }
+}
+
+/**
+ * @private
+ * @brief Draws a pixel to backbuffer of the current terminal.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          x
+ *                 X position
+ *
+ * @param          y
+ *                 Y position
+ *
+ * @param          r
+ *                 Red color value (0-255)
+ *
+ * @param          g
+ *                 Green color value (0-255)
+ *
+ * @param          b
+ *                 Blue color value (0-255)
+ */
+void
+nighterm_putpixel(struct nighterm_ctx *context,
+                         uint64_t x,
+                         uint64_t y,
+                         uint8_t r,
+                         uint8_t g,
+                         uint8_t b)
+{
+  if (context->backbuffer == NULL || x >= context->backbuffer_width ||
+      y >= context->backbuffer_height) {
+    return;
+  }
+
+  context->fill_span(context->backbuffer + y * context->backbuffer_pitch +
+                       x * context->fb_bytes_per_pixel,
+                     nighterm_pack_color(context, r, g, b),
+                     1);
+}
+
+/**
+ * @private
+ * @brief Marks all damage bands as clean, and the back page of a flipping
+ *        host as entirely stale.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_reset_damage(struct nighterm_ctx *context)
+{
+  for (uint32_t band = 0; band < context->bands; band++) {
+    context->damage[band].x0 = (uint32_t)context->fb_width;
+    context->damage[band].x1 = 0;
+    /* Nothing is known about the contents of the back page. */
+    context->flip_damage[band].x0 = 0;
+    context->flip_damage[band].x1 = (uint32_t)context->fb_width;
+  }
+
+  context->damage_first = context->bands;
+  context->damage_last = 0;
+}
+
+/**
+ * @private
+ * @brief Marks a rectangle of the backbuffer as damaged, so that the next
+ *        flush copies it to the framebuffer.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          x
+ *                 X position in pixels
+ *
+ * @param          y
+ *                 Y position in pixels
+ *
+ * @param          width
+ *                 Width of the rectangle in pixels
+ *
+ * @param          height
+ *                 Height of the rectangle in pixels
+ */
+void
+nighterm_damage(struct nighterm_ctx *context,
+                uint64_t x,
+                uint64_t y,
+                uint64_t width,
+                uint64_t height)
+{
+  if (x >= context->fb_width || y >= context->fb_height || width == 0 ||
+      height == 0) {
+    return;
+  }
+
+  if (x + width > context->fb_width) {
+    width = context->fb_width - x;
+  }
+  if (y + height > context->fb_height) {
+    height = context->fb_height - y;
+  }
+
+  /* The last band also covers everything below the text area. */
+  uint32_t first = (uint32_t)(y / context->cell_height);
+  uint32_t last = (uint32_t)((y + height - 1) / context->cell_height);
+  if (first >= context->bands) {
+    first = context->bands - 1;
+  }
+  if (last >= context->bands) {
+    last = context->bands - 1;
+  }
+
+  for (uint32_t band = first; band <= last; band++) {
+    struct nighterm_span *span = &context->damage[band];
+    if (x < span->x0) {
+      span->x0 = (uint32_t)x;
+    }
+    if (x + width > span->x1) {
+      span->x1 = (uint32_t)(x + width);
+    }
+  }
+
+  if (first < context->damage_first) {
+    context->damage_first = first;
+  }
+  if (last > context->damage_last) {
+    context->damage_last = last;
+  }
+}
+
+/**
+ * @private
+ * @brief Translates a screen row into its row in the character grid and
+ *        the backbuffer, which are both rings starting at row_origin.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          row
+ *                 Screen row, less than context->rows
+ *
+ * @return         Physical row
+ */
+uint32_t
+nighterm_phys_row(struct nighterm_ctx *context, uint32_t row)
+{
+  row += context->row_origin;
+  return row >= context->rows ? row - context->rows : row;
+}
+
+/**
+ * @private
+ * @brief Translates a row of the character grid and the backbuffer into
+ *        its screen row; the inverse of nighterm_phys_row().
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          phys
+ *                 Physical row, less than context->rows
+ *
+ * @return         Screen row
+ */
+uint32_t
+nighterm_screen_row(const struct nighterm_ctx *context, uint32_t phys)
+{
+  if (phys >= context->row_origin) {
+    return phys - context->row_origin;
+  }
+  return phys + context->rows - context->row_origin;
+}
+
+/**
+ * @private
+ * @brief Returns a pointer to the backbuffer line that holds a scanline of
+ *        the screen.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          y
+ *                 Screen Y position in pixels
+ *
+ * Without a backbuffer, this is the framebuffer line the scanline is
+ * shown from.
+ *
+ * @return         Pointer to the first pixel of the line
+ */
+uint8_t *
+nighterm_backbuffer_line(struct nighterm_ctx *context, uint64_t y)
+{
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    return (uint8_t *)context->fb_addr +
+           (context->pan_y + y) * context->fb_pitch;
+  }
+
+  uint64_t text_height = (uint64_t)context->rows * context->cell_height;
+
+  if (y < text_height) {
+    uint32_t row = (uint32_t)(y / context->cell_height);
+    y = (uint64_t)nighterm_phys_row(context, row) * context->cell_height +
+        y % context->cell_height;
+  }
+
+  return context->backbuffer + y * context->backbuffer_pitch;
+}
+
+/**
+ * @private
+ * @brief Fills a rectangle of the backbuffer with a single packed color
+ *        and marks it as damaged.
+ *
+ * The first row is filled by the format's span filler, the remaining
+ * rows are copies of it. Parts outside of the backbuffer only set the
+ * border color, which the next flush fills into the framebuffer.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          x
+ *                 X position in pixels
+ *
+ * @param          y
+ *                 Y position in pixels
+ *
+ * @param          width
+ *                 Width of the rectangle in pixels
+ *
+ * @param          height
+ *                 Height of the rectangle in pixels
+ *
+ * @param          color
+ *                 Color packed by nighterm_pack_color()
+ */
+void
+nighterm_fill_rect(struct nighterm_ctx *context,
+                   uint64_t x,
+                   uint64_t y,
+                   uint64_t width,
+                   uint64_t height,
+                   uint32_t color)
+{
+  if (x >= context->fb_width || y >= context->fb_height) {
+    return;
+  }
+  if (x + width > context->fb_width) {
+    width = context->fb_width - x;
+  }
+  if (y + height > context->fb_height) {
+    height = context->fb_height - y;
+  }
+  if (width == 0 || height == 0) {
+    return;
+  }
+
+  if (x + width > (uint64_t)context->cols * context->cell_width ||
+      y + height > (uint64_t)context->rows * context->cell_height) {
+    context->border_color = color;
+  }
+
+  nighterm_damage(context, x, y, width, height);
+
+  if (x >= context->backbuffer_width || y >= context->backbuffer_height) {
+    return;
+  }
+  if (x + width > context->backbuffer_width) {
+    width = context->backbuffer_width - x;
+  }
+  if (y + height > context->backbuffer_height) {
+    height = context->backbuffer_height - y;
+  }
+
+  uint64_t length = width * context->fb_bytes_per_pixel;
+  uint64_t offset = x * context->fb_bytes_per_pixel;
+  uint8_t *row = nighterm_backbuffer_line(context, y) + offset;
+
+  context->fill_span(row, color, width);
+
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    /* Reading the framebuffer back is slow; fill every line instead. */
+    for (uint64_t line = 1; line < height; line++) {
+      context->fill_span(
+        nighterm_backbuffer_line(context, y + line) + offset, color, width);
+    }
+    NIGHTERM_STAT_ADD(context, vram_bytes, height * length);
+    return;
+  }
+
+  for (uint64_t line = 1; line < height; line++) {
+    nighterm_memcpy(
+      nighterm_backbuffer_line(context, y + line) + offset, row, length);
+  }
+}
+
+/**
+ * @private
+ * @brief Parses a PSF2 font.
+ *
+ * @param          font
+ *                 Pointer to a buffer containing the font
+ *
+ * @param          size
+ *                 Size of the buffer in bytes
+ *
+ * @param ptr      header
+ *                 Parsed font header
+ *
+ * @param ptr      data
+ *                 Pointer to the first glyph's bitmap
+ *
+ * @return         NIGHTERM_SUCCESS if the font is valid;
+ *                 NIGHTERM_FONT_INVALID otherwise.
+ */
+int
+nighterm_parse_font(void *font,
+                    uint64_t size,
+                    struct nighterm_psf2_header *header,
+                    void **data)
+{
+  if (size < sizeof(struct nighterm_psf2_header)) {
+    return NIGHTERM_FONT_INVALID;
+  }
+
+  nighterm_memcpy(header, font, sizeof(struct nighterm_psf2_header));
+
+  if (header->magic != NIGHTERM_PSF2_MAGIC ||
+      header->headersize < sizeof(struct nighterm_psf2_header)) {
+    return NIGHTERM_FONT_INVALID;
+  }
+
+  if (header->width < 1 || header->height < 1 || header->numglyph < 1 ||
+      header->bytesperglyph < header->height * ((header->width + 7) >> 3)) {
+    return NIGHTERM_FONT_INVALID;
+  }
+
+  /* The glyphs must fit; the Unicode table is bounded while it is read. */
+  if ((uint64_t)header->headersize +
+        (uint64_t)header->numglyph * header->bytesperglyph > size) {
+    return NIGHTERM_FONT_INVALID;
+  }
+
+  *data = (uint8_t *)font + header->headersize;
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @private
+ * @brief Hashes a codepoint into the Unicode overflow table.
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @return         Index of the first slot to probe
+ */
+uint32_t
+nighterm_unicode_hash(uint32_t codepoint)
+{
+  return (codepoint * 0x9E3779B1u >> 16) & (NIGHTERM_UNICODE_OVERFLOW - 1);
+}
+
+/**
+ * @private
+ * @brief Maps a codepoint to a glyph, unless it is already mapped.
+ *        Mappings that do not fit into the overflow table are dropped.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @param          glyph
+ *                 Glyph index
+ */
+void
+nighterm_map_codepoint(struct nighterm_ctx *context,
+                       uint32_t codepoint,
+                       uint32_t glyph)
+{
+  if (codepoint < NIGHTERM_UNICODE_DIRECT) {
+    if (context->unicode_direct[codepoint] == UINT16_MAX) {
+      context->unicode_direct[codepoint] = (uint16_t)glyph;
+    }
+    return;
+  }
+
+  uint32_t slot = nighterm_unicode_hash(codepoint);
+  for (uint32_t i = 0; i < NIGHTERM_UNICODE_OVERFLOW; i++) {
+    struct nighterm_unicode_entry *entry = &context->unicode_overflow[slot];
+    if (entry->codepoint == codepoint) {
+      return;
+    }
+    if (entry->codepoint == UINT32_MAX) {
+      entry->codepoint = codepoint;
+      entry->glyph = glyph;
+      return;
+    }
+    slot = (slot + 1) & (NIGHTERM_UNICODE_OVERFLOW - 1);
+  }
+}
+
+/**
+ * @private
+ * @brief Looks up the glyph a codepoint is mapped to.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @return         Glyph index, or UINT32_MAX if the codepoint is not
+ *                 mapped.
+ */
+uint32_t
+nighterm_find_codepoint(const struct nighterm_ctx *context, uint32_t codepoint)
+{
+  if (codepoint < NIGHTERM_UNICODE_DIRECT) {
+    uint16_t glyph = context->unicode_direct[codepoint];
+    return glyph != UINT16_MAX ? glyph : UINT32_MAX;
+  }
+
+  uint32_t slot = nighterm_unicode_hash(codepoint);
+  for (uint32_t i = 0; i < NIGHTERM_UNICODE_OVERFLOW; i++) {
+    const struct nighterm_unicode_entry *entry =
+      &context->unicode_overflow[slot];
+    if (entry->codepoint == codepoint) {
+      return entry->glyph;
+    }
+    if (entry->codepoint == UINT32_MAX) {
+      break;
+    }
+    slot = (slot + 1) & (NIGHTERM_UNICODE_OVERFLOW - 1);
+  }
+
+  return UINT32_MAX;
+}
+
+/**
+ * @private
+ * @brief Looks up the glyph of a codepoint.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @return         Glyph index, or the font's replacement glyph if the
+ *                 codepoint is not mapped.
+ */
+uint32_t
+nighterm_glyph_index(struct nighterm_ctx *context, uint32_t codepoint)
+{
+  uint32_t glyph = nighterm_find_codepoint(context, codepoint);
+  return glyph != UINT32_MAX ? glyph : context->unicode_fallback;
+}
+
+/**
+ * @private
+ * @brief Builds the codepoint to glyph index from the current font's
+ *        Unicode table. Fonts without a table map codepoints to the glyph
+ *        of the same index.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_build_unicode_index(struct nighterm_ctx *context)
+{
+  struct nighterm_psf2_header *header = &context->font_header;
+
+  for (uint32_t i = 0; i < NIGHTERM_UNICODE_DIRECT; i++) {
+    context->unicode_direct[i] = UINT16_MAX;
+  }
+  for (uint32_t i = 0; i < NIGHTERM_UNICODE_OVERFLOW; i++) {
+    context->unicode_overflow[i].codepoint = UINT32_MAX;
+  }
+
+  if ((header->flags & NIGHTERM_PSF2_HAS_UNICODE_TABLE) == 0) {
+    for (uint32_t glyph = 0; glyph < header->numglyph && glyph < UINT16_MAX;
+         glyph++) {
+      nighterm_map_codepoint(context, glyph, glyph);
+    }
+  } else {
+    const uint8_t *table = (const uint8_t *)context->font_data +
+                           (uint64_t)header->numglyph * header->bytesperglyph;
+    const uint8_t *end = (const uint8_t *)context->font + context->font_size;
+
+    /* A truncated table maps the glyphs it got to. */
+    for (uint32_t glyph = 0; glyph < header->numglyph && table < end; glyph++) {
+      /* Single codepoints come first; sequences after 0xFE are skipped. */
+      int sequences = 0;
+      while (table < end && *table != 0xFF) {
+        if (*table == 0xFE) {
+          sequences = 1;
+          table++;
+          continue;
+        }
+
+        uint32_t codepoint = *table++;
+        uint32_t extra = 0;
+        if (codepoint >= 0xF0) {
+          codepoint &= 0x07;
+          extra = 3;
+        } else if (codepoint >= 0xE0) {
+          codepoint &= 0x0F;
+          extra = 2;
+        } else if (codepoint >= 0xC0) {
+          codepoint &= 0x1F;
+          extra = 1;
+        }
+        for (; extra > 0 && table < end && (*table & 0xC0) == 0x80;
+             extra--) {
+          codepoint = (codepoint << 6) | (*table++ & 0x3F);
+        }
+
+        if (!sequences && glyph < UINT16_MAX) {
+          nighterm_map_codepoint(context, codepoint, glyph);
+        }
+      }
+      if (table < end) {
+        table++;
+      }
+    }
+  }
+
+  context->unicode_fallback = nighterm_find_codepoint(context, 0xFFFD);
+  if (context->unicode_fallback == UINT32_MAX) {
+    context->unicode_fallback = nighterm_find_codepoint(context, '?');
+  }
+  if (context->unicode_fallback == UINT32_MAX) {
+    context->unicode_fallback = 0;
+  }
+}
+
+/**
+ * @private
+ * @brief Empties the glyph cache.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_invalidate_glyphs(struct nighterm_ctx *context)
+{
+  for (uint32_t i = 0; i < NIGHTERM_GLYPH_CACHE_SIZE; i++) {
+    context->glyph_slots[i].glyph = UINT32_MAX;
+    context->glyph_slots[i].last_used = 0;
+  }
+
+  context->glyph_tick = 0;
+}
+
+/**
+ * @private
+ * @brief Returns a pointer to a cell of the character grid.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          col
+ *                 Column of the cell
+ *
+ * @param          row
+ *                 Row of the cell
+ *
+ * @return         Pointer to the cell
+ */
+struct nighterm_cell *
+nighterm_cell_at(struct nighterm_ctx *context, uint32_t col, uint32_t row)
+{
+  return &context->cells[nighterm_phys_row(context, row) * context->cols + col];
+}
+
+/**
+ * @private
+ * @brief Marks a span of cells in a row as changed, so that the next
+ *        nighterm_render() rasterizes them.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          row
+ *                 Screen row of the cells
+ *
+ * @param          first
+ *                 First changed column
+ *
+ * @param          end
+ *                 Column after the last changed one
+ */
+void
+nighterm_mark_dirty(struct nighterm_ctx *context,
+                    uint32_t row,
+                    uint32_t first,
+                    uint32_t end)
+{
+  if (context->background) {
+    /* Background terminals are repainted whole when switched to. */
+    return;
+  }
+
+  row = nighterm_phys_row(context, row);
+
+  struct nighterm_span *span = &context->dirty[row];
+
+  if (first < span->x0) {
+    span->x0 = first;
+  }
+  if (end > span->x1) {
+    span->x1 = end;
+  }
+
+  if (row < context->dirty_first) {
+    context->dirty_first = row;
+  }
+  if (row > context->dirty_last) {
+    context->dirty_last = row;
+  }
+}
+
+/**
+ * @private
+ * @brief Marks all cells as unchanged.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_reset_dirty(struct nighterm_ctx *context)
+{
+  for (uint32_t row = 0; row < context->rows; row++) {
+    context->dirty[row].x0 = context->cols;
+    context->dirty[row].x1 = 0;
+  }
+
+  context->dirty_first = context->rows;
+  context->dirty_last = 0;
+}
+
+/**
+ * @private
+ * @brief Stores a character into a cell, marking the cell as changed only
+ *        if its contents differ.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          col
+ *                 Column of the cell
+ *
+ * @param          row
+ *                 Row of the cell
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ */
+void
+nighterm_set_cell(struct nighterm_ctx *context,
+                  uint32_t col,
+                  uint32_t row,
+                  uint32_t codepoint,
+                  uint32_t fg,
+                  uint32_t bg)
+{
+  if (col >= context->cols || row >= context->rows) {
+    return;
+  }
+
+  struct nighterm_cell *cell = nighterm_cell_at(context, col, row);
+  if (cell->codepoint == codepoint && cell->fg == fg && cell->bg == bg) {
+    return;
+  }
+
+  cell->codepoint = codepoint;
+  cell->fg = fg;
+  cell->bg = bg;
+  nighterm_mark_dirty(context, row, col, col + 1);
+}
+
+/**
+ * @private
+ * @brief Stores a run of printable ASCII characters into a row, marking
+ *        only the cells whose contents differ as changed.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          col
+ *                 Column of the first cell
+ *
+ * @param          row
+ *                 Row of the cells
+ *
+ * @param          chars
+ *                 Characters, at most cols - col of them
+ *
+ * @param          count
+ *                 Amount of characters
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ */
+void
+nighterm_set_cells(struct nighterm_ctx *context,
+                   uint32_t col,
+                   uint32_t row,
+                   const char *chars,
+                   uint32_t count,
+                   uint32_t fg,
+                   uint32_t bg)
+{
+  if (col >= context->cols || row >= context->rows) {
+    return;
+  }
+  if (count > context->cols - col) {
+    count = context->cols - col;
+  }
+
+  struct nighterm_cell *cells = nighterm_cell_at(context, col, row);
+  uint32_t first = count;
+  uint32_t end = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t codepoint = (uint8_t)chars[i];
+    if (cells[i].codepoint != codepoint || cells[i].fg != fg ||
+        cells[i].bg != bg) {
+      cells[i].codepoint = codepoint;
+      cells[i].fg = fg;
+      cells[i].bg = bg;
+      if (first == count) {
+        first = i;
+      }
+      end = i + 1;
+    }
+  }
+
+  if (first < end) {
+    nighterm_mark_dirty(context, row, col + first, col + end);
+  }
+}
+
+/**
+ * @private
+ * @brief Blanks a span of cells in a row with the current colors, marking
+ *        only the cells whose contents differ as changed.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          row
+ *                 Row of the cells
+ *
+ * @param          first
+ *                 First column to blank
+ *
+ * @param          end
+ *                 Column after the last one to blank
+ */
+void
+nighterm_erase_cells(struct nighterm_ctx *context,
+                     uint32_t row,
+                     uint32_t first,
+                     uint32_t end)
+{
+  if (row >= context->rows) {
+    return;
+  }
+  if (end > context->cols) {
+    end = context->cols;
+  }
+
+  struct nighterm_cell *cells = nighterm_cell_at(context, 0, row);
+  struct nighterm_cell blank = { ' ', context->fg_color, context->bg_color };
+  uint32_t changed_first = end;
+  uint32_t changed_end = first;
+
+  for (uint32_t col = first; col < end; col++) {
+    if (cells[col].codepoint != blank.codepoint || cells[col].fg != blank.fg ||
+        cells[col].bg != blank.bg) {
+      cells[col] = blank;
+      if (changed_first == end) {
+        changed_first = col;
+      }
+      changed_end = col + 1;
+    }
+  }
+
+  if (changed_first < changed_end) {
+    nighterm_mark_dirty(context, row, changed_first, changed_end);
+  }
+}
+
+/**
+ * @private
+ * @brief Shifts the cells of a row from a column to its end left or right,
+ *        blanking the cells shifted in, as for deleted or inserted
+ *        characters. Only the cells whose contents differ are marked as
+ *        changed.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          row
+ *                 Row of the cells
+ *
+ * @param          col
+ *                 First column to shift
+ *
+ * @param          count
+ *                 Amount of columns to shift by
+ *
+ * @param          right
+ *                 Non-zero to shift right, zero to shift left
+ */
+void
+nighterm_shift_cells(struct nighterm_ctx *context,
+                     uint32_t row,
+                     uint32_t col,
+                     uint32_t count,
+                     int right)
+{
+  if (row >= context->rows || col >= context->cols) {
+    return;
+  }
+  if (count > context->cols - col) {
+    count = context->cols - col;
+  }
+
+  struct nighterm_cell *cells = nighterm_cell_at(context, 0, row);
+  struct nighterm_cell blank = { ' ', context->fg_color, context->bg_color };
+  uint32_t changed_first = context->cols;
+  uint32_t changed_end = col;
+
+  for (uint32_t i = col; i < context->cols; i++) {
+    /* Right shifts walk backwards so no cell is read after it moved. */
+    uint32_t dest = right ? context->cols - 1 - (i - col) : i;
+    struct nighterm_cell cell = blank;
+    if (right ? dest >= col + count : dest + count < context->cols) {
+      cell = cells[right ? dest - count : dest + count];
+    }
+
+    if (cells[dest].codepoint != cell.codepoint || cells[dest].fg != cell.fg ||
+        cells[dest].bg != cell.bg) {
+      cells[dest] = cell;
+      if (dest < changed_first) {
+        changed_first = dest;
+      }
+      if (dest + 1 > changed_end) {
+        changed_end = dest + 1;
+      }
+    }
+  }
+
+  if (changed_first < changed_end) {
+    nighterm_mark_dirty(context, row, changed_first, changed_end);
+  }
+}
+
+/**
+ * @private
+ * @brief Packs a direct SGR color into the framebuffer's pixel format.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          color
+ *                 SGR color with NIGHTERM_SGR_RGB set
+ *
+ * @return         Packed pixel value
+ */
+uint32_t
+nighterm_pack_sgr_rgb(struct nighterm_ctx *context, uint32_t color)
+{
+  return nighterm_pack_color(context,
+                             (uint8_t)(color >> 16),
+                             (uint8_t)(color >> 8),
+                             (uint8_t)color);
+}
+
+/**
+ * @private
+ * @brief Packs the colors of a graphic rendition.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          sgr_fg
+ *                 SGR foreground color
+ *
+ * @param          sgr_bg
+ *                 SGR background color
+ *
+ * @param          flags
+ *                 SGR attribute flags
+ *
+ * @param ptr      fg
+ *                 Receives the packed foreground color
+ *
+ * @param ptr      bg
+ *                 Receives the packed background color
+ */
+void
+nighterm_resolve_colors(struct nighterm_ctx *context,
+                        uint32_t sgr_fg,
+                        uint32_t sgr_bg,
+                        uint8_t flags,
+                        uint32_t *fg,
+                        uint32_t *bg)
+{
+  *fg = context->default_fg;
+  *bg = context->default_bg;
+
+  if (sgr_fg & NIGHTERM_SGR_RGB) {
+    *fg = nighterm_pack_sgr_rgb(context, sgr_fg);
+  } else if (sgr_fg < NIGHTERM_PALETTE_SIZE) {
+    /* Bold brightens the 8 base colors. */
+    if ((flags & NIGHTERM_SGR_BOLD) && sgr_fg < 8) {
+      sgr_fg += 8;
+    }
+    *fg = context->palette[sgr_fg];
+  }
+  if (sgr_bg & NIGHTERM_SGR_RGB) {
+    *bg = nighterm_pack_sgr_rgb(context, sgr_bg);
+  } else if (sgr_bg < NIGHTERM_PALETTE_SIZE) {
+    *bg = context->palette[sgr_bg];
+  }
+
+  if (flags & NIGHTERM_SGR_REVERSE) {
+    uint32_t tmp = *fg;
+    *fg = *bg;
+    *bg = tmp;
+  }
+}
+
+/**
+ * @private
+ * @brief Derives the colors of newly written cells from the graphic
+ *        rendition. Cells already written keep their colors.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_update_pen(struct nighterm_ctx *context)
+{
+  nighterm_resolve_colors(context,
+                          context->sgr_fg,
+                          context->sgr_bg,
+                          context->sgr_flags,
+                          &context->fg_color,
+                          &context->bg_color);
+}
+
+/**
+ * @private
+ * @brief Moves the character grid to new dimensions, keeping the top left
+ *        part that fits and blanking the rest. Works in place.
+ *
+ * @param          blank
+ *                 Cell stored into the new part of the grid
+ *
+ * @param          dest
+ *                 New grid, new_cols * new_rows cells
+ *
+ * @param          src
+ *                 Old grid, old_cols * old_rows cells; may equal dest
+ *
+ * @param          old_cols
+ *                 Old amount of columns
+ *
+ * @param          old_rows
+ *                 Old amount of rows
+ *
+ * @param          new_cols
+ *                 New amount of columns
+ *
+ * @param          new_rows
+ *                 New amount of rows
+ */
+void
+nighterm_relayout_cells(struct nighterm_cell blank,
+                        struct nighterm_cell *dest,
+                        struct nighterm_cell *src,
+                        uint32_t old_cols,
+                        uint32_t old_rows,
+                        uint32_t new_cols,
+                        uint32_t new_rows)
+{
+  if (src == NULL) {
+    old_cols = 0;
+    old_rows = 0;
+  }
+
+  uint32_t keep_cols = old_cols < new_cols ? old_cols : new_cols;
+  uint32_t keep_rows = old_rows < new_rows ? old_rows : new_rows;
+
+  /* Rows move towards the start when narrowing and towards the end when
+   * widening, so walk in the direction that never overwrites a source. */
+  if (new_cols <= old_cols) {
+    for (uint32_t row = 0; row < keep_rows; row++) {
+      for (uint32_t col = 0; col < keep_cols; col++) {
+        dest[row * new_cols + col] = src[row * old_cols + col];
+      }
+    }
+  } else {
+    for (uint32_t row = keep_rows; row-- > 0;) {
+      for (uint32_t col = keep_cols; col-- > 0;) {
+        dest[row * new_cols + col] = src[row * old_cols + col];
+      }
+    }
+  }
+
+  for (uint32_t row = 0; row < new_rows; row++) {
+    uint32_t col = row < keep_rows ? keep_cols : 0;
+    for (; col < new_cols; col++) {
+      dest[row * new_cols + col] = blank;
+    }
+  }
+}
+
+/**
+ * @private
+ * @brief Reverses a range of cells in place.
+ *
+ * @param          cells
+ *                 Pointer to the first cell
+ *
+ * @param          count
+ *                 Amount of cells
+ */
+void
+nighterm_reverse_cells(struct nighterm_cell *cells, uint64_t count)
+{
+  for (uint64_t i = 0, j = count; i + 1 < j; i++) {
+    j--;
+    struct nighterm_cell tmp = cells[i];
+    cells[i] = cells[j];
+    cells[j] = tmp;
+  }
+}
+
+/**
+ * @private
+ * @brief Rotates the character grid in place so that the ring starts at
+ *        the first row again. The backbuffer is not rotated.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_unroll_cells(struct nighterm_ctx *context)
+{
+  if (context->row_origin == 0) {
+    return;
+  }
+
+  uint64_t total = (uint64_t)context->rows * context->cols;
+  uint64_t head = (uint64_t)context->row_origin * context->cols;
+
+  nighterm_reverse_cells(context->cells, head);
+  nighterm_reverse_cells(context->cells + head, total - head);
+  nighterm_reverse_cells(context->cells, total);
+
+  for (uint32_t row = 0; row < context->rows; row++) {
+    context->dirty[row].x0 = 0;
+    context->dirty[row].x1 = context->cols;
+  }
+  context->dirty_first = 0;
+  context->dirty_last = context->rows ? context->rows - 1 : 0;
+  context->row_origin = 0;
+}
+
+/**
+ * @private
+ * @brief Clears the backbuffer to the background color and marks every
+ *        cell as changed, for when the rendering of all cells changes.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_invalidate_screen(struct nighterm_ctx *context)
+{
+  nighterm_fill_rect(context,
+                     0,
+                     0,
+                     context->fb_width,
+                     context->fb_height,
+                     context->bg_color);
+  context->cursor_drawn = 0;
+
+  for (uint32_t row = 0; row < context->rows; row++) {
+    nighterm_mark_dirty(context, row, 0, context->cols);
+  }
+}
+
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+/**
+ * @private
+ * @brief Frees memory allocated through the host allocator, if any.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          ptr
+ *                 Pointer to the memory, or NULL
+ */
+void
+nighterm_release(struct nighterm_ctx *context, void *ptr)
+{
+  if (ptr != NULL) {
+    context->free(ptr);
+  }
+}
+#endif
+
+/**
+ * @private
+ * @brief Parses a font and resizes everything that depends on the glyph
+ *        size: the character grid, damage bands and the glyph cache.
+ *        The text is kept and all cells are marked as changed.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          font
+ *                 Pointer to a buffer containing a PSF2 font
+ *
+ * @param          size
+ *                 Size of the buffer in bytes
+ *
+ * @return         NIGHTERM_SUCCESS if the font has been loaded;
+ *                 error code otherwise.
+ */
+int
+nighterm_load_font(struct nighterm_ctx *context, void *font, uint64_t size)
+{
+  struct nighterm_psf2_header header;
+  void *data;
+
+  int status = nighterm_parse_font(font, size, &header, &data);
+  if (status != NIGHTERM_SUCCESS) {
+    return status;
+  }
+
+  uint64_t bytes_per_pixel = context->fb_bytes_per_pixel;
+  uint32_t rows = (uint32_t)(context->fb_height / header.height);
+  uint32_t cols = (uint32_t)(context->fb_width / header.width);
+#ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+  /* Larger screens get a margin around the largest grid that fits, and
+   * glyphs under 8x8 pixels cannot outgrow NIGHTERM_TERMINAL_SIZE(). */
+  uint64_t max_rows = context->fb_height / 8;
+  uint64_t max_cols = context->fb_width / 8;
+  if (max_rows > NIGHTERM_MAX_ROWS) {
+    max_rows = NIGHTERM_MAX_ROWS;
+  }
+  if (max_cols > NIGHTERM_MAX_COLS) {
+    max_cols = NIGHTERM_MAX_COLS;
+  }
+  if (rows > max_rows) {
+    rows = (uint32_t)max_rows;
+  }
+  if (cols > max_cols) {
+    cols = (uint32_t)max_cols;
+  }
+#endif
+  /* One band per row, and one for the bottom margin. */
+  uint32_t bands = rows + 1;
+  uint64_t glyph_bytes = header.width * header.height * bytes_per_pixel;
+
+  uint64_t backbuffer_width = context->fb_width;
+  uint64_t backbuffer_height = context->fb_height;
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_TEXT) {
+    backbuffer_width = (uint64_t)cols * header.width;
+    backbuffer_height = (uint64_t)rows * header.height;
+  }
+  uint64_t backbuffer_pitch = backbuffer_width * bytes_per_pixel;
+  uint64_t backbuffer_size = backbuffer_pitch * backbuffer_height;
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    backbuffer_pitch = context->fb_pitch;
+    backbuffer_size = 0;
+  }
+
+  int grow = backbuffer_size > context->backbuffer_size;
+  if (grow && !context->backbuffer_owned) {
+    /* Caller storage too small for the text area of this font. */
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+
+  if (context->rows > 0) {
+    nighterm_unroll_cells(context);
+  }
+
+  struct nighterm_cell blank = { ' ', context->fg_color, context->bg_color };
+
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  struct nighterm_span *damage = (struct nighterm_span *)context->malloc(
+    bands * sizeof(struct nighterm_span));
+  uint8_t *glyph_pixels =
+    (uint8_t *)context->malloc(NIGHTERM_GLYPH_CACHE_SIZE * glyph_bytes);
+  struct nighterm_cell *cells = (struct nighterm_cell *)context->malloc(
+    (size_t)rows * cols * sizeof(struct nighterm_cell));
+  struct nighterm_span *dirty = (struct nighterm_span *)context->malloc(
+    rows * sizeof(struct nighterm_span));
+  struct nighterm_span *flip_damage = (struct nighterm_span *)context->malloc(
+    bands * sizeof(struct nighterm_span));
+  uint8_t *backbuffer =
+    grow ? (uint8_t *)context->malloc(backbuffer_size) : context->backbuffer;
+  if (damage == NULL || glyph_pixels == NULL || cells == NULL ||
+      dirty == NULL || flip_damage == NULL || (grow && backbuffer == NULL)) {
+    nighterm_release(context, damage);
+    nighterm_release(context, glyph_pixels);
+    nighterm_release(context, cells);
+    nighterm_release(context, dirty);
+    nighterm_release(context, flip_damage);
+    if (grow) {
+      nighterm_release(context, backbuffer);
+    }
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+
+  nighterm_relayout_cells(blank,
+                          cells,
+                          context->cells,
+                          context->cols,
+                          context->rows,
+                          cols,
+                          rows);
+
+  nighterm_release(context, context->damage);
+  nighterm_release(context, context->glyph_pixels);
+  nighterm_release(context, context->cells);
+  nighterm_release(context, context->dirty);
+  nighterm_release(context, context->flip_damage);
+  context->flip_damage = flip_damage;
+  context->damage = damage;
+  context->glyph_pixels = glyph_pixels;
+  context->cells = cells;
+  context->dirty = dirty;
+  if (grow) {
+    nighterm_release(context, context->backbuffer);
+    context->backbuffer = backbuffer;
+    context->backbuffer_size = backbuffer_size;
+  }
+#else
+  if (glyph_bytes > NIGHTERM_MAX_GLYPH_BYTES) {
+    return NIGHTERM_FONT_INVALID;
+  }
+
+  nighterm_relayout_cells(blank,
+                          context->cells,
+                          context->cells,
+                          context->cols,
+                          context->rows,
+                          cols,
+                          rows);
+#endif
+
+  context->font_header = header;
+  context->font = font;
+  context->font_size = size;
+  context->font_data = data;
+  context->cell_width = header.width;
+  context->cell_height = header.height;
+  context->rows = rows;
+  context->cols = cols;
+  context->scroll_top = 0;
+  context->scroll_bottom = rows;
+  context->bands = bands;
+  context->backbuffer_width = backbuffer_width;
+  context->backbuffer_height = backbuffer_height;
+  context->backbuffer_pitch = backbuffer_pitch;
+
+  nighterm_build_unicode_index(context);
+  nighterm_reset_damage(context);
+  nighterm_invalidate_glyphs(context);
+
+  /* Every cell moves, and the margins change size. */
+  nighterm_reset_dirty(context);
+  nighterm_invalidate_screen(context);
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @private
+ * @brief Expands a glyph's bitmap into packed pixels.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          dest
+ *                 Pointer to the top left pixel
+ *
+ * @param          pitch
+ *                 Distance between two rows of dest in bytes
+ *
+ * @param          glyph
+ *                 Glyph index
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ */
+void
+nighterm_expand_glyph(struct nighterm_ctx *context,
+                      uint8_t *dest,
+                      uint64_t pitch,
+                      uint32_t glyph,
+                      uint32_t fg,
+                      uint32_t bg)
+{
+  uint32_t stride = (context->font_header.width + 7) >> 3;
+  const uint8_t *bitmap = (const uint8_t *)context->font_data +
+                          glyph * context->font_header.bytesperglyph;
+
+  for (uint32_t y = 0; y < context->cell_height; y++) {
+    context->glyph_span(dest, bitmap, context->cell_width, fg, bg);
+    dest += pitch;
+    bitmap += stride;
+  }
+}
+
+/**
+ * @private
+ * @brief Finds a glyph in the glyph cache without updating the cache, so
+ *        that render jobs can share it.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          glyph
+ *                 Glyph index
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ *
+ * @param optional victim
+ *                 Least recently used slot of the glyph's set
+ *
+ * @return         Slot holding the glyph, or NIGHTERM_GLYPH_CACHE_SIZE if
+ *                 it is not cached.
+ */
+uint32_t
+nighterm_find_glyph(const struct nighterm_ctx *context,
+                    uint32_t glyph,
+                    uint32_t fg,
+                    uint32_t bg,
+                    uint32_t *victim)
+{
+  uint32_t hash = glyph * 0x9E3779B1u ^ fg * 0x85EBCA77u ^ bg * 0xC2B2AE3Du;
+  uint32_t sets = NIGHTERM_GLYPH_CACHE_SIZE / NIGHTERM_GLYPH_CACHE_WAYS;
+  uint32_t first = ((hash >> 16) & (sets - 1)) * NIGHTERM_GLYPH_CACHE_WAYS;
+  uint32_t oldest = first;
+
+  for (uint32_t i = first; i < first + NIGHTERM_GLYPH_CACHE_WAYS; i++) {
+    const struct nighterm_glyph_slot *slot = &context->glyph_slots[i];
+    if (slot->glyph == glyph && slot->fg == fg && slot->bg == bg) {
+      return i;
+    }
+    if (slot->last_used < context->glyph_slots[oldest].last_used) {
+      oldest = i;
+    }
+  }
+
+  if (victim != NULL) {
+    *victim = oldest;
+  }
+  return NIGHTERM_GLYPH_CACHE_SIZE;
+}
+
+/**
+ * @private
+ * @brief Looks a glyph up in the glyph cache, expanding it into the least
+ *        recently used slot of its set on a miss.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          glyph
+ *                 Glyph index
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ *
+ * @return         Pointer to the expanded glyph, cell_width pixels per row.
+ */
+const uint8_t *
+nighterm_cache_glyph(struct nighterm_ctx *context,
+                     uint32_t glyph,
+                     uint32_t fg,
+                     uint32_t bg)
+{
+  uint64_t bytes_per_pixel = context->fb_bytes_per_pixel;
+  uint64_t row_bytes = context->cell_width * bytes_per_pixel;
+  uint64_t glyph_bytes = row_bytes * context->cell_height;
+
+  uint32_t victim;
+  uint32_t index = nighterm_find_glyph(context, glyph, fg, bg, &victim);
+
+  context->glyph_tick++;
+
+  if (index < NIGHTERM_GLYPH_CACHE_SIZE) {
+    context->glyph_slots[index].last_used = context->glyph_tick;
+    NIGHTERM_STAT_ADD(context, glyph_cache_hits, 1);
+    return context->glyph_pixels + index * glyph_bytes;
+  }
+
+  struct nighterm_glyph_slot *slot = &context->glyph_slots[victim];
+  uint8_t *pixels = context->glyph_pixels + victim * glyph_bytes;
+
+  NIGHTERM_STAT_ADD(context, glyph_cache_misses, 1);
+  nighterm_expand_glyph(context, pixels, row_bytes, glyph, fg, bg);
+  slot->glyph = glyph;
+  slot->fg = fg;
+  slot->bg = bg;
+  slot->last_used = context->glyph_tick;
+
+  return pixels;
+}
+
+/**
+ * @private
+ * @brief Draws a glyph into a character cell of the backbuffer.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          glyph
+ *                 Glyph index
+ *
+ * @param          col
+ *                 Column of the cell
+ *
+ * @param          row
+ *                 Screen row of the cell
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ */
+void
+nighterm_draw_glyph(struct nighterm_ctx *context,
+                    uint32_t glyph,
+                    uint32_t col,
+                    uint32_t row,
+                    uint32_t fg,
+                    uint32_t bg)
+{
+  if (col >= context->cols || row >= context->rows) {
+    return;
+  }
+
+  if (glyph >= context->font_header.numglyph) {
+    glyph = 0;
+  }
+
+  uint64_t bytes_per_pixel = context->fb_bytes_per_pixel;
+  uint64_t row_bytes = context->cell_width * bytes_per_pixel;
+  uint64_t x = (uint64_t)col * context->cell_width;
+  uint64_t y = (uint64_t)row * context->cell_height;
+
+  const uint8_t *pixels = nighterm_cache_glyph(context, glyph, fg, bg);
+  uint8_t *dest = nighterm_backbuffer_line(context, y) + x * bytes_per_pixel;
+
+  for (uint32_t line = 0; line < context->cell_height; line++) {
+    nighterm_memcpy(dest, pixels, row_bytes);
+    dest += context->backbuffer_pitch;
+    pixels += row_bytes;
+  }
+
+  nighterm_damage(context, x, y, context->cell_width, context->cell_height);
+  NIGHTERM_STAT_ADD(context, glyphs_rasterized, 1);
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    NIGHTERM_STAT_ADD(context, vram_bytes, row_bytes * context->cell_height);
+  }
+}
+
+/**
+ * @private
+ * @brief Rows handed to one render job, and what it counted. Each job owns
+ *        one, on its own cache line.
+ */
+struct nighterm_render_band
+{
+  uint32_t first;
+  uint32_t end;
+  uint64_t glyphs;
+  uint64_t hits;
+  uint64_t misses;
+} __attribute__((aligned(64)));
+
+/**
+ * @private
+ * @brief Render split into jobs.
+ */
+struct nighterm_render_work
+{
+  struct nighterm_ctx *context;
+  struct nighterm_render_band bands[NIGHTERM_RENDER_JOBS];
+};
+
+/**
+ * @private
+ * @brief Draws a glyph into a character cell of the backbuffer, from a
+ *        render job or, without one, through nighterm_draw_glyph().
+ *
+ * Jobs run concurrently, so they only read shared state: the glyph cache
+ * is looked up but not updated, glyphs that miss are expanded straight
+ * into the backbuffer, and damage is left to the caller.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param optional band
+ *                 Band of the render job; NULL outside of jobs
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ *
+ * @param          col
+ *                 Column of the cell
+ *
+ * @param          row
+ *                 Screen row of the cell
+ *
+ * @param          fg
+ *                 Packed foreground color
+ *
+ * @param          bg
+ *                 Packed background color
+ */
+void
+nighterm_put_glyph(struct nighterm_ctx *context,
+                   struct nighterm_render_band *band,
+                   uint32_t codepoint,
+                   uint32_t col,
+                   uint32_t row,
+                   uint32_t fg,
+                   uint32_t bg)
+{
+  uint32_t glyph = nighterm_glyph_index(context, codepoint);
+
+  if (band == NULL) {
+    nighterm_draw_glyph(context, glyph, col, row, fg, bg);
+    return;
+  }
+
+  if (col >= context->cols || row >= context->rows) {
+    return;
+  }
+  if (glyph >= context->font_header.numglyph) {
+    glyph = 0;
+  }
+
+  uint64_t row_bytes = context->cell_width * context->fb_bytes_per_pixel;
+  uint64_t glyph_bytes = row_bytes * context->cell_height;
+  uint8_t *dest =
+    nighterm_backbuffer_line(context, (uint64_t)row * context->cell_height) +
+    col * row_bytes;
+
+  uint32_t index = nighterm_find_glyph(context, glyph, fg, bg, NULL);
+
+  band->glyphs++;
+
+  if (index < NIGHTERM_GLYPH_CACHE_SIZE) {
+    const uint8_t *pixels = context->glyph_pixels + index * glyph_bytes;
+    for (uint32_t line = 0; line < context->cell_height; line++) {
+      nighterm_memcpy(dest, pixels, row_bytes);
+      dest += context->backbuffer_pitch;
+      pixels += row_bytes;
+    }
+    band->hits++;
+    return;
+  }
+
+  nighterm_expand_glyph(context, dest, context->backbuffer_pitch, glyph, fg, bg);
+  band->misses++;
+}
+
+/**
+ * @private
+ * @brief Removes the cursor overlay by marking the cell under it as
+ *        changed, so that the next nighterm_render() draws the cell again.
+ *        Touches no pixels.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_hide_cursor(struct nighterm_ctx *context)
+{
+  if (!context->cursor_drawn || context->background) {
+    /* A background terminal's state is in the context, but the overlay
+     * belongs to the active one. */
+    return;
+  }
+
+  uint32_t row = nighterm_screen_row(context, context->cursor_row);
+  nighterm_mark_dirty(context, row, context->cursor_col, context->cursor_col + 1);
+  context->cursor_drawn = 0;
+}
+
+/**
+ * @private
+ * @brief Checks whether the cursor overlay should be on screen.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @return         Non-zero if the cursor is visible and in its blink on
+ *                 phase, and the cursor is on the screen.
+ */
+int
+nighterm_cursor_shown(struct nighterm_ctx *context)
+{
+  return (context->cursor_flags & NIGHTERM_CURSOR_VISIBLE) &&
+         !context->cursor_blink_off && context->cur_y < context->rows &&
+         context->cols > 0 && context->history.view == 0;
+}
+
+/**
+ * @private
+ * @brief Prepares the cursor overlay for rendering: takes it off its cell
+ *        if it is about to move or disappear, and forgets about it if the
+ *        cell is redrawn anyway.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_prepare_cursor(struct nighterm_ctx *context)
+{
+  if (!context->cursor_drawn) {
+    return;
+  }
+
+  uint32_t col = context->cur_x < context->cols ? context->cur_x
+                                                : context->cols - 1;
+  if (!nighterm_cursor_shown(context) ||
+      context->cursor_row != nighterm_phys_row(context, context->cur_y) ||
+      context->cursor_col != col) {
+    nighterm_hide_cursor(context);
+    return;
+  }
+
+  struct nighterm_span *span = &context->dirty[context->cursor_row];
+  if (span->x0 <= col && col < span->x1) {
+    context->cursor_drawn = 0;
+  }
+}
+
+/**
+ * @private
+ * @brief Draws the cursor overlay over the cell under the cursor, if it
+ *        is shown and not drawn yet. Only the pixels of that cell change.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_draw_cursor(struct nighterm_ctx *context)
+{
+  if (context->cursor_drawn || !nighterm_cursor_shown(context)) {
+    return;
+  }
+
+  /* A pending wrap leaves the cursor past the last column. */
+  uint32_t col = context->cur_x < context->cols ? context->cur_x
+                                                : context->cols - 1;
+  uint32_t row = context->cur_y;
+  struct nighterm_cell *cell = nighterm_cell_at(context, col, row);
+  uint64_t x = (uint64_t)col * context->cell_width;
+  uint64_t y = (uint64_t)row * context->cell_height;
+  uint32_t thickness = context->cell_height / 8 ? context->cell_height / 8 : 1;
+
+  switch (context->cursor_style) {
+    case NIGHTERM_CURSOR_UNDERLINE:
+      nighterm_fill_rect(context,
+                         x,
+                         y + context->cell_height - thickness,
+                         context->cell_width,
+                         thickness,
+                         cell->fg);
+      break;
+    case NIGHTERM_CURSOR_BAR:
+      nighterm_fill_rect(context,
+                         x,
+                         y,
+                         thickness < context->cell_width ? thickness
+                                                         : context->cell_width,
+                         context->cell_height,
+                         cell->fg);
+      break;
+    default:
+      nighterm_draw_glyph(context,
+                          nighterm_glyph_index(context, cell->codepoint),
+                          col,
+                          row,
+                          cell->bg,
+                          cell->fg);
+      break;
+  }
+
+  context->cursor_drawn = 1;
+  context->cursor_row = nighterm_phys_row(context, row);
+  context->cursor_col = col;
+}
+
+/**
+ * @private
+ * @brief Renders the changed cells of a band of physical rows.
+ *
+ * @param          arg
+ *                 struct nighterm_render_work
+ *
+ * @param          index
+ *                 Index of the band
+ */
+void
+nighterm_render_job(void *arg, uint32_t index)
+{
+  struct nighterm_render_work *work = (struct nighterm_render_work *)arg;
+  struct nighterm_ctx *context = work->context;
+  struct nighterm_render_band *band = &work->bands[index];
+
+  for (uint32_t phys = band->first; phys < band->end; phys++) {
+    struct nighterm_span *span = &context->dirty[phys];
+    struct nighterm_cell *cells = &context->cells[phys * context->cols];
+    uint32_t row = nighterm_screen_row(context, phys);
+
+    for (uint32_t col = span->x0; col < span->x1; col++) {
+      nighterm_put_glyph(context,
+                         band,
+                         cells[col].codepoint,
+                         col,
+                         row,
+                         cells[col].fg,
+                         cells[col].bg);
+    }
+
+    span->x0 = context->cols;
+    span->x1 = 0;
+  }
+}
+
+/**
+ * @private
+ * @brief Splits rows into bands of at least NIGHTERM_RENDER_JOB_ROWS rows
+ *        and runs a job for each through the host's run_jobs callback.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          job
+ *                 Job run for every band
+ *
+ * @param          first
+ *                 First row
+ *
+ * @param          last
+ *                 Last row
+ */
+void
+nighterm_run_render_jobs(struct nighterm_ctx *context,
+                         nighterm_job job,
+                         uint32_t first,
+                         uint32_t last)
+{
+  struct nighterm_render_work work;
+  uint32_t total = last - first + 1;
+  uint32_t jobs = total / NIGHTERM_RENDER_JOB_ROWS;
+  if (jobs > NIGHTERM_RENDER_JOBS) {
+    jobs = NIGHTERM_RENDER_JOBS;
+  }
+  if (jobs == 0) {
+    jobs = 1;
+  }
+  uint32_t per_job = (total + jobs - 1) / jobs;
+
+  work.context = context;
+  for (uint32_t i = 0; i < jobs; i++) {
+    struct nighterm_render_band *band = &work.bands[i];
+    band->first = first + i * per_job;
+    band->end = band->first + per_job < last + 1 ? band->first + per_job
+                                                  : last + 1;
+    band->glyphs = 0;
+    band->hits = 0;
+    band->misses = 0;
+  }
+
+  context->hooks.run_jobs(context->hooks.user, job, &work, jobs);
+
+  for (uint32_t i = 0; i < jobs; i++) {
+    NIGHTERM_STAT_ADD(context, glyphs_rasterized, work.bands[i].glyphs);
+    NIGHTERM_STAT_ADD(context, glyph_cache_hits, work.bands[i].hits);
+    NIGHTERM_STAT_ADD(context, glyph_cache_misses, work.bands[i].misses);
+    if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+      NIGHTERM_STAT_ADD(context,
+                        vram_bytes,
+                        work.bands[i].glyphs * context->cell_width *
+                          context->cell_height * context->fb_bytes_per_pixel);
+    }
+  }
+}
+
+/**
+ * @private
+ * @brief Checks whether enough rows changed to be worth rendering in
+ *        parallel.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          rows
+ *                 Amount of rows to be rendered
+ *
+ * @return         Non-zero if the rows should be split into render jobs.
+ */
+int
+nighterm_should_split(struct nighterm_ctx *context, uint32_t rows)
+{
+  return context->hooks.run_jobs != NULL &&
+         rows >= 2 * NIGHTERM_RENDER_JOB_ROWS;
+}
+
+/**
+ * @private
+ * @brief Rasterizes all changed cells into the backbuffer, in parallel if
+ *        the host supplies run_jobs and enough rows changed.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_render(struct nighterm_ctx *context)
+{
+  if (context->history.view != 0) {
+    /* The scrollback covers the grid; changes wait for the live view. */
+    return;
+  }
+
+  NIGHTERM_STAT_START(context);
+
+  /* Output shows a blinking cursor steadily until the next blink. */
+  if (context->dirty_first <= context->dirty_last) {
+    context->cursor_blink_off = 0;
+  }
+  nighterm_prepare_cursor(context);
+
+  uint32_t first = context->dirty_first;
+  uint32_t last = context->dirty_last < context->rows ? context->dirty_last
+                                                      : context->rows - 1;
+  if (first <= last && nighterm_should_split(context, last - first + 1)) {
+    /* Damage is shared, so it is marked up front. */
+    for (uint32_t phys = first; phys <= last; phys++) {
+      struct nighterm_span *span = &context->dirty[phys];
+      if (span->x0 < span->x1) {
+        uint32_t row = nighterm_screen_row(context, phys);
+        nighterm_damage(context,
+                        (uint64_t)span->x0 * context->cell_width,
+                        (uint64_t)row * context->cell_height,
+                        (uint64_t)(span->x1 - span->x0) * context->cell_width,
+                        context->cell_height);
+      }
+    }
+
+    nighterm_run_render_jobs(context, nighterm_render_job, first, last);
+
+    context->dirty_first = context->rows;
+    context->dirty_last = 0;
+  }
+
+  for (uint32_t phys = context->dirty_first;
+       phys <= context->dirty_last && phys < context->rows;
+       phys++) {
+    struct nighterm_span *span = &context->dirty[phys];
+    struct nighterm_cell *cells = &context->cells[phys * context->cols];
+    uint32_t row = nighterm_screen_row(context, phys);
+
+    for (uint32_t col = span->x0; col < span->x1; col++) {
+      nighterm_draw_glyph(context,
+                          nighterm_glyph_index(context, cells[col].codepoint),
+                          col,
+                          row,
+                          cells[col].fg,
+                          cells[col].bg);
+    }
+
+    span->x0 = context->cols;
+    span->x1 = 0;
+  }
+
+  context->dirty_first = context->rows;
+  context->dirty_last = 0;
+
+  nighterm_draw_cursor(context);
+
+  NIGHTERM_STAT_STOP(context, render_time);
+}
+
+/**
+ * @private
+ * @brief Checks whether scrolling can pan the display.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @return         Non-zero if the host supports panning and has at least
+ *                 one row of cells worth of spare framebuffer memory.
+ */
+int
+nighterm_can_pan(struct nighterm_ctx *context)
+{
+  return context->hooks.set_scanout_offset != NULL &&
+         context->hooks.flip_page == NULL &&
+         context->hooks.scanout_height >=
+           context->fb_height + context->cell_height;
+}
+
+#define NIGHTERM_HISTORY_WIDE 0x01
+#define NIGHTERM_HISTORY_HEADER 7
+#define NIGHTERM_HISTORY_TRAILER 2
+#define NIGHTERM_HISTORY_RUN 10
+
+/**
+ * @private
+ * @brief Stores a little endian value into the scrollback arena.
+ *
+ * @param          history
+ *                 Scrollback
+ *
+ * @param          pos
+ *                 Offset of the first byte; wraps around the arena
+ *
+ * @param          value
+ *                 Value to be stored
+ *
+ * @param          bytes
+ *                 Size of the value in bytes (1-4)
+ */
+void
+nighterm_history_put(struct nighterm_history *history,
+                     uint32_t pos,
+                     uint32_t value,
+                     uint32_t bytes)
+{
+  for (uint32_t i = 0; i < bytes; i++) {
+    history->data[(pos + i) & history->mask] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+/**
+ * @private
+ * @brief Loads a little endian value from the scrollback arena.
+ *
+ * @param          history
+ *                 Scrollback
+ *
+ * @param          pos
+ *                 Offset of the first byte; wraps around the arena
+ *
+ * @param          bytes
+ *                 Size of the value in bytes (1-4)
+ *
+ * @return         The value.
+ */
+uint32_t
+nighterm_history_get(const struct nighterm_history *history,
+                     uint32_t pos,
+                     uint32_t bytes)
+{
+  uint32_t value = 0;
+
+  for (uint32_t i = 0; i < bytes; i++) {
+    value |= (uint32_t)history->data[(pos + i) & history->mask]
+             << (8 * i);
+  }
+
+  return value;
+}
+
+/**
+ * @private
+ * @brief Appends a line to the scrollback, evicting the oldest lines until
+ *        it fits. Lines that could never fit are dropped.
+ *
+ * @param          history
+ *                 Scrollback; nothing is stored if it has no arena
+ *
+ * @param          cells
+ *                 Cells of the line
+ *
+ * @param          cols
+ *                 Amount of cells in the line
+ */
+void
+nighterm_history_push(struct nighterm_history *history,
+                      const struct nighterm_cell *cells,
+                      uint32_t cols)
+{
+  if (history->data == NULL || cols == 0) {
+    return;
+  }
+
+  /* Trailing blanks are implied by the colors of the last run. */
+  struct nighterm_cell last = cells[cols - 1];
+  uint32_t chars = cols;
+  if (last.codepoint == ' ') {
+    while (chars > 0 && cells[chars - 1].codepoint == ' ' &&
+           cells[chars - 1].fg == last.fg && cells[chars - 1].bg == last.bg) {
+      chars--;
+    }
+  }
+
+  uint32_t runs = 0;
+  uint8_t flags = 0;
+  for (uint32_t i = 0; i < chars; i++) {
+    if (i == 0 || cells[i].fg != cells[i - 1].fg ||
+        cells[i].bg != cells[i - 1].bg) {
+      runs++;
+    }
+    if (cells[i].codepoint > 0x7F) {
+      flags |= NIGHTERM_HISTORY_WIDE;
+    }
+  }
+  int fill = chars == 0 || cells[chars - 1].fg != last.fg ||
+             cells[chars - 1].bg != last.bg;
+  if (fill) {
+    runs++;
+  }
+
+  uint32_t width = flags & NIGHTERM_HISTORY_WIDE ? 3 : 1;
+  uint64_t length = NIGHTERM_HISTORY_HEADER + (uint64_t)runs * NIGHTERM_HISTORY_RUN +
+                    (uint64_t)chars * width + NIGHTERM_HISTORY_TRAILER;
+  uint64_t size = (uint64_t)history->mask + 1;
+  if (length > 0xFFFF || length > size) {
+    return;
+  }
+
+  while (size - history->used < length) {
+    uint32_t evicted = nighterm_history_get(history, history->tail, 2);
+    history->tail = (history->tail + evicted) & history->mask;
+    history->used -= evicted;
+    history->lines--;
+  }
+
+  uint32_t pos = history->head;
+  nighterm_history_put(history, pos, (uint32_t)length, 2);
+  nighterm_history_put(history, pos + 2, flags, 1);
+  nighterm_history_put(history, pos + 3, chars, 2);
+  nighterm_history_put(history, pos + 5, runs, 2);
+  pos += NIGHTERM_HISTORY_HEADER;
+
+  for (uint32_t i = 0; i < chars;) {
+    uint32_t count = 1;
+    while (i + count < chars && cells[i + count].fg == cells[i].fg &&
+           cells[i + count].bg == cells[i].bg) {
+      count++;
+    }
+    nighterm_history_put(history, pos, count, 2);
+    nighterm_history_put(history, pos + 2, cells[i].fg, 4);
+    nighterm_history_put(history, pos + 6, cells[i].bg, 4);
+    pos += NIGHTERM_HISTORY_RUN;
+    i += count;
+  }
+  if (fill) {
+    nighterm_history_put(history, pos, 0, 2);
+    nighterm_history_put(history, pos + 2, last.fg, 4);
+    nighterm_history_put(history, pos + 6, last.bg, 4);
+    pos += NIGHTERM_HISTORY_RUN;
+  }
+
+  for (uint32_t i = 0; i < chars; i++) {
+    nighterm_history_put(history, pos, cells[i].codepoint, width);
+    pos += width;
+  }
+  nighterm_history_put(history, pos, (uint32_t)length, 2);
+
+  history->head = (history->head + (uint32_t)length) & history->mask;
+  history->used += (uint32_t)length;
+  history->lines++;
+  history->view_top = history->head;
+}
+
+/**
+ * @private
+ * @brief Finds the line shown on the top row when the view is scrolled back
+ *        by a given amount of lines, walking from the closest known record.
+ *
+ * @param          history
+ *                 Scrollback
+ *
+ * @param          view
+ *                 Lines scrolled back, at most history->lines
+ *
+ * @return         Offset of the line's record.
+ */
+uint32_t
+nighterm_history_seek(const struct nighterm_history *history, uint32_t view)
+{
+  uint32_t pos = history->view_top;
+  uint32_t from = history->view;
+  uint32_t distance = from > view ? from - view : view - from;
+
+  if (view < distance) {
+    pos = history->head;
+    from = 0;
+    distance = view;
+  }
+  if (history->lines - view < distance) {
+    pos = history->tail;
+    from = history->lines;
+  }
+
+  for (; from < view; from++) {
+    pos -= nighterm_history_get(history, pos - 2, 2);
+  }
+  for (; from > view; from--) {
+    pos += nighterm_history_get(history, pos, 2);
+  }
+
+  return pos & history->mask;
+}
+
+/**
+ * @private
+ * @brief Draws a scrollback line into a screen row of the backbuffer.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param optional band
+ *                 Band of the render job; NULL outside of jobs
+ *
+ * @param          pos
+ *                 Offset of the line's record
+ *
+ * @param          row
+ *                 Screen row
+ *
+ * @return         Offset of the next record.
+ */
+uint32_t
+nighterm_history_draw(struct nighterm_ctx *context,
+                      struct nighterm_render_band *band,
+                      uint32_t pos,
+                      uint32_t row)
+{
+  const struct nighterm_history *history = &context->history;
+  uint32_t length = nighterm_history_get(history, pos, 2);
+  uint32_t flags = nighterm_history_get(history, pos + 2, 1);
+  uint32_t runs = nighterm_history_get(history, pos + 5, 2);
+  uint32_t width = flags & NIGHTERM_HISTORY_WIDE ? 3 : 1;
+  uint32_t run = pos + NIGHTERM_HISTORY_HEADER;
+  uint32_t text = run + runs * NIGHTERM_HISTORY_RUN;
+  uint32_t col = 0;
+  uint32_t fg = 0;
+  uint32_t bg = 0;
+
+  for (uint32_t i = 0; i < runs; i++) {
+    uint32_t count = nighterm_history_get(history, run, 2);
+    fg = nighterm_history_get(history, run + 2, 4);
+    bg = nighterm_history_get(history, run + 6, 4);
+    run += NIGHTERM_HISTORY_RUN;
+
+    for (; count > 0 && col < context->cols; count--, col++) {
+      uint32_t codepoint = nighterm_history_get(history, text, width);
+      text += width;
+      nighterm_put_glyph(context, band, codepoint, col, row, fg, bg);
+    }
+  }
+
+  for (; col < context->cols; col++) {
+    nighterm_put_glyph(context, band, ' ', col, row, fg, bg);
+  }
+
+  return (pos + length) & history->mask;
+}
+
+/**
+ * @private
+ * @brief Draws screen rows of the scrolled back view: scrollback lines on
+ *        top, followed by the top rows of the grid.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param optional band
+ *                 Band of the render job; NULL outside of jobs
+ *
+ * @param          first
+ *                 First screen row
+ *
+ * @param          end
+ *                 Screen row past the last one
+ */
+void
+nighterm_paint_view_rows(struct nighterm_ctx *context,
+                         struct nighterm_render_band *band,
+                         uint32_t first,
+                         uint32_t end)
+{
+  const struct nighterm_history *history = &context->history;
+  uint32_t pos = history->view_top;
+
+  for (uint32_t row = 0; row < first && row < history->view; row++) {
+    pos += nighterm_history_get(history, pos, 2);
+  }
+
+  for (uint32_t row = first; row < end; row++) {
+    if (row < history->view) {
+      pos = nighterm_history_draw(context, band, pos, row);
+      continue;
+    }
+
+    uint32_t phys = nighterm_phys_row(context, row - history->view);
+    struct nighterm_cell *cells = &context->cells[phys * context->cols];
+    for (uint32_t col = 0; col < context->cols; col++) {
+      nighterm_put_glyph(context,
+                         band,
+                         cells[col].codepoint,
+                         col,
+                         row,
+                         cells[col].fg,
+                         cells[col].bg);
+    }
+  }
+}
+
+/**
+ * @private
+ * @brief Draws a band of screen rows of the scrolled back view.
+ *
+ * @param          arg
+ *                 struct nighterm_render_work
+ *
+ * @param          index
+ *                 Index of the band
+ */
+void
+nighterm_paint_view_job(void *arg, uint32_t index)
+{
+  struct nighterm_render_work *work = (struct nighterm_render_work *)arg;
+  struct nighterm_render_band *band = &work->bands[index];
+
+  nighterm_paint_view_rows(work->context, band, band->first, band->end);
+}
+
+/**
+ * @private
+ * @brief Draws the scrolled back view.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_paint_view(struct nighterm_ctx *context)
+{
+  if (!nighterm_should_split(context, context->rows)) {
+    nighterm_paint_view_rows(context, NULL, 0, context->rows);
+    return;
+  }
+
+  nighterm_damage(context,
+                  0,
+                  0,
+                  (uint64_t)context->cols * context->cell_width,
+                  (uint64_t)context->rows * context->cell_height);
+  nighterm_run_render_jobs(
+    context, nighterm_paint_view_job, 0, context->rows - 1);
+}
+
+/**
+ * @private
+ * @brief Returns a scrolled back view to the live screen; every cell is
+ *        redrawn by the next render.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_leave_view(struct nighterm_ctx *context)
+{
+  if (context->history.view == 0) {
+    return;
+  }
+
+  context->history.view = 0;
+  context->history.view_top = context->history.head;
+
+  for (uint32_t row = 0; row < context->rows; row++) {
+    nighterm_mark_dirty(context, row, 0, context->cols);
+  }
+}
+
+/**
+ * @private
+ * @brief Fills the margins around the text area with the border color.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_fill_border(struct nighterm_ctx *context)
+{
+  uint64_t text_width = (uint64_t)context->cols * context->cell_width;
+  uint64_t text_height = (uint64_t)context->rows * context->cell_height;
+
+  nighterm_fill_rect(context,
+                     text_width,
+                     0,
+                     context->fb_width - text_width,
+                     text_height,
+                     context->border_color);
+  nighterm_fill_rect(context,
+                     0,
+                     text_height,
+                     context->fb_width,
+                     context->fb_height - text_height,
+                     context->border_color);
+}
+
+/**
+ * @private
+ * @brief Finishes scrolling without a backbuffer. Panning keeps the rows
+ *        already on screen, so only the new bottom row and the margins
+ *        are drawn; otherwise every cell is redrawn from the grid.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_scroll_direct(struct nighterm_ctx *context)
+{
+  if (nighterm_can_pan(context) &&
+      context->pan_y + context->cell_height + context->fb_height <=
+        context->hooks.scanout_height) {
+    context->pan_y += context->cell_height;
+    nighterm_fill_border(context);
+    return;
+  }
+
+  /* Out of framebuffer memory, start over at the top. */
+  context->pan_y = 0;
+  nighterm_fill_border(context);
+  for (uint32_t row = 0; row < context->rows; row++) {
+    nighterm_mark_dirty(context, row, 0, context->cols);
+  }
+}
+
+/**
+ * @private
+ * @brief Scrolls the text area up by one row.
+ *
+ * The grid and the backbuffer are rings, so this only advances their
+ * origin and blanks the recycled row; the next flush recomposes the
+ * visible rows in order. If the host can pan, the next flush only writes
+ * the new bottom row and moves the scanout offset instead. Without a
+ * backbuffer, see nighterm_scroll_direct().
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_scroll(struct nighterm_ctx *context)
+{
+  if (context->rows == 0) {
+    return;
+  }
+
+  NIGHTERM_STAT_ADD(context, scrolls, 1);
+
+  /* The old top row becomes the new bottom row. */
+  struct nighterm_cell *cells =
+    &context->cells[context->row_origin * context->cols];
+  nighterm_history_push(&context->history, cells, context->cols);
+
+  struct nighterm_cell blank = { ' ', context->fg_color, context->bg_color };
+  for (uint32_t col = 0; col < context->cols; col++) {
+    cells[col] = blank;
+  }
+
+  context->row_origin++;
+  if (context->row_origin == context->rows) {
+    context->row_origin = 0;
+  }
+
+  if (context->background) {
+    return;
+  }
+
+  nighterm_mark_dirty(context, context->rows - 1, 0, context->cols);
+
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    nighterm_scroll_direct(context);
+    return;
+  }
+
+  if (nighterm_can_pan(context)) {
+    if (context->pan_y + context->cell_height + context->fb_height <=
+        context->hooks.scanout_height) {
+      /* The rows already in framebuffer memory only need to be panned to;
+       * pending damage moves up with them. */
+      context->pan_y += context->cell_height;
+
+      for (uint32_t band = 0; band + 1 < context->bands; band++) {
+        context->damage[band] = context->damage[band + 1];
+      }
+      context->damage[context->bands - 1].x0 = (uint32_t)context->fb_width;
+      context->damage[context->bands - 1].x1 = 0;
+      if (context->damage_first > 0) {
+        context->damage_first--;
+      }
+      if (context->damage_last > 0) {
+        context->damage_last--;
+      }
+
+      nighterm_damage(context,
+                      0,
+                      (uint64_t)(context->rows - 1) * context->cell_height,
+                      context->fb_width,
+                      context->fb_height);
+      return;
+    }
+
+    /* Out of framebuffer memory, start over at the top. */
+    context->pan_y = 0;
+    nighterm_damage(context, 0, 0, context->fb_width, context->fb_height);
+    return;
+  }
+
+  nighterm_damage(context,
+                  0,
+                  0,
+                  context->fb_width,
+                  (uint64_t)context->rows * context->cell_height);
+}
+
+/**
+ * @private
+ * @brief Copies a row of cells over another one, along with its pixels in
+ *        the backbuffer and whatever of them is still to be rendered.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          dest
+ *                 Screen row to be overwritten
+ *
+ * @param          src
+ *                 Screen row to be copied
+ */
+void
+nighterm_copy_row(struct nighterm_ctx *context, uint32_t dest, uint32_t src)
+{
+  uint32_t dest_phys = nighterm_phys_row(context, dest);
+  uint32_t src_phys = nighterm_phys_row(context, src);
+
+  nighterm_memcpy(&context->cells[dest_phys * context->cols],
+                  &context->cells[src_phys * context->cols],
+                  context->cols * sizeof(struct nighterm_cell));
+
+  if (context->background) {
+    return;
+  }
+
+  if (context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+    /* Reading the framebuffer back is slow; draw the row again. */
+    nighterm_mark_dirty(context, dest, 0, context->cols);
+    return;
+  }
+
+  nighterm_memcpy(
+    nighterm_backbuffer_line(context, (uint64_t)dest * context->cell_height),
+    nighterm_backbuffer_line(context, (uint64_t)src * context->cell_height),
+    (size_t)context->cell_height * context->backbuffer_pitch);
+
+  struct nighterm_span span = context->dirty[src_phys];
+  context->dirty[dest_phys].x0 = context->cols;
+  context->dirty[dest_phys].x1 = 0;
+  if (span.x0 < span.x1) {
+    nighterm_mark_dirty(context, dest, span.x0, span.x1);
+  }
+}
+
+/**
+ * @private
+ * @brief Moves a range of rows up or down, blanking the rows moved in.
+ *        Rows outside of the range stay as they are.
+ *
+ * Cells and backbuffer rows are copied rather than rendered again, so
+ * this costs a copy of the affected rows; only the blanked rows are
+ * rasterized.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          top
+ *                 First row of the range
+ *
+ * @param          end
+ *                 Row after the last row of the range
+ *
+ * @param          count
+ *                 Amount of rows to move by
+ *
+ * @param          up
+ *                 Non-zero to move the rows up, zero to move them down
+ */
+void
+nighterm_move_rows(struct nighterm_ctx *context,
+                   uint32_t top,
+                   uint32_t end,
+                   uint32_t count,
+                   int up)
+{
+  if (end > context->rows || top >= end || count == 0) {
+    return;
+  }
+  if (count > end - top) {
+    count = end - top;
+  }
+
+  NIGHTERM_STAT_ADD(context, scrolls, 1);
+
+  /* The overlay must not be copied along with the pixels under it. */
+  nighterm_hide_cursor(context);
+
+  if (up) {
+    for (uint32_t row = top; row + count < end; row++) {
+      nighterm_copy_row(context, row, row + count);
+    }
+  } else {
+    for (uint32_t row = end - 1; row >= top + count; row--) {
+      nighterm_copy_row(context, row, row - count);
+    }
+  }
+
+  if (!context->background &&
+      context->backbuffer_mode != NIGHTERM_BACKBUFFER_NONE) {
+    nighterm_damage(context,
+                    0,
+                    (uint64_t)top * context->cell_height,
+                    (uint64_t)context->cols * context->cell_width,
+                    (uint64_t)(end - top) * context->cell_height);
+  }
+
+  /* The rows moved out of keep pixels matching their old cells. */
+  uint32_t first = up ? end - count : top;
+  for (uint32_t row = first; row < first + count; row++) {
+    nighterm_erase_cells(context, row, 0, context->cols);
+  }
+}
+
+/**
+ * @private
+ * @brief Scrolls the scroll region up, keeping the lines scrolled off the
+ *        whole screen in the scrollback.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          count
+ *                 Amount of rows to scroll by
+ */
+void
+nighterm_scroll_up(struct nighterm_ctx *context, uint32_t count)
+{
+  if (context->scroll_top == 0 && context->scroll_bottom == context->rows) {
+    /* The rings rotate instead of being moved. */
+    if (count > context->rows) {
+      count = context->rows;
+    }
+    while (count-- > 0) {
+      nighterm_scroll(context);
+    }
+    return;
+  }
+
+  nighterm_move_rows(
+    context, context->scroll_top, context->scroll_bottom, count, 1);
+}
+
+/**
+ * @private
+ * @brief Moves the cursor down a line, scrolling if it is on the bottom
+ *        line of the scroll region.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_linefeed(struct nighterm_ctx *context)
+{
+  if (context->cur_y + 1 == context->scroll_bottom) {
+    nighterm_scroll_up(context, 1);
+  } else if (context->cur_y + 1 < context->rows) {
+    context->cur_y++;
+  }
+}
+
+/**
+ * @private
+ * @brief Moves the cursor to the start of the next line, scrolling if it
+ *        is on the bottom line of the scroll region.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_newline(struct nighterm_ctx *context)
+{
+  context->cur_x = 0;
+  nighterm_linefeed(context);
+}
+
+/*
+ * Escape sequence parser.
+ *
+ * A DEC/ANSI state machine after Paul Williams' VT500 parser: every byte
+ * is mapped to a class, and the class and the current state index a
+ * transition table giving the next state and the action to run.
+ * OSC, DCS, SOS, PM and APC strings are consumed and ignored.
+ */
+
+/**
+ * @private
+ * @brief Parser states.
+ */
+enum nighterm_vt_state
+{
+  NIGHTERM_VT_GROUND,
+  NIGHTERM_VT_ESCAPE,
+  NIGHTERM_VT_ESCAPE_INTERMEDIATE,
+  NIGHTERM_VT_CSI_ENTRY,
+  NIGHTERM_VT_CSI_PARAM,
+  NIGHTERM_VT_CSI_INTERMEDIATE,
+  NIGHTERM_VT_CSI_IGNORE,
+  NIGHTERM_VT_STRING,
+  NIGHTERM_VT_STATES
+};
+
+/**
+ * @private
+ * @brief Byte classes.
+ */
+enum nighterm_vt_class
+{
+  NIGHTERM_VT_C0,           /* Control characters */
+  NIGHTERM_VT_BEL,          /* 0x07, also terminates strings */
+  NIGHTERM_VT_CAN,          /* 0x18 and 0x1A, abort a sequence */
+  NIGHTERM_VT_ESC,          /* 0x1B */
+  NIGHTERM_VT_INTERMEDIATE, /* 0x20-0x2F */
+  NIGHTERM_VT_DIGIT,        /* 0x30-0x39 */
+  NIGHTERM_VT_SEPARATOR,    /* ':' and ';' */
+  NIGHTERM_VT_PRIVATE,      /* 0x3C-0x3F */
+  NIGHTERM_VT_CSI,          /* '[' */
+  NIGHTERM_VT_OSC,          /* ']' */
+  NIGHTERM_VT_STRING_START, /* 'P', 'X', '^' and '_' */
+  NIGHTERM_VT_FINAL,        /* Other 0x40-0x7E */
+  NIGHTERM_VT_DEL,          /* 0x7F */
+  NIGHTERM_VT_HIGH,         /* 0x80-0xFF */
+  NIGHTERM_VT_CLASSES
+};
+
+/**
+ * @private
+ * @brief Parser actions.
+ */
+enum nighterm_vt_action
+{
+  NIGHTERM_VT_NONE,
+  NIGHTERM_VT_PRINT,
+  NIGHTERM_VT_EXECUTE,
+  NIGHTERM_VT_CLEAR,
+  NIGHTERM_VT_COLLECT,
+  NIGHTERM_VT_PARAM,
+  NIGHTERM_VT_ESC_DISPATCH,
+  NIGHTERM_VT_CSI_DISPATCH
+};
+
+/**
+ * @private
+ * @brief Class of every byte, 16 bytes to a row through two-letter
+ *        aliases of the classes.
+ */
+#define C0 NIGHTERM_VT_C0
+#define BL NIGHTERM_VT_BEL
+#define CN NIGHTERM_VT_CAN
+#define ES NIGHTERM_VT_ESC
+#define IM NIGHTERM_VT_INTERMEDIATE
+#define DG NIGHTERM_VT_DIGIT
+#define SP NIGHTERM_VT_SEPARATOR
+#define PV NIGHTERM_VT_PRIVATE
+#define CS NIGHTERM_VT_CSI
+#define OS NIGHTERM_VT_OSC
+#define ST NIGHTERM_VT_STRING_START
+#define FI NIGHTERM_VT_FINAL
+#define DL NIGHTERM_VT_DEL
+#define HI NIGHTERM_VT_HIGH
+static const uint8_t nighterm_vt_classes[256] = {
+  /* 0x00 */ C0, C0, C0, C0, C0, C0, C0, BL, C0, C0, C0, C0, C0, C0, C0, C0,
+  /* 0x10 */ C0, C0, C0, C0, C0, C0, C0, C0, CN, C0, CN, ES, C0, C0, C0, C0,
+  /* 0x20 */ IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM, IM,
+  /* 0x30 */ DG, DG, DG, DG, DG, DG, DG, DG, DG, DG, SP, SP, PV, PV, PV, PV,
+  /* 0x40 */ FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI,
+  /* 0x50 */ ST, FI, FI, FI, FI, FI, FI, FI, ST, FI, FI, CS, FI, OS, ST, ST,
+  /* 0x60 */ FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI,
+  /* 0x70 */ FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, FI, DL,
+  /* 0x80 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0x90 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xA0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xB0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xC0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xD0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xE0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+  /* 0xF0 */ HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI, HI,
+};
+#undef C0
+#undef BL
+#undef CN
+#undef ES
+#undef IM
+#undef DG
+#undef SP
+#undef PV
+#undef CS
+#undef OS
+#undef ST
+#undef FI
+#undef DL
+#undef HI
+
+/**
+ * @private
+ * @brief Encodes a transition: action in the high nibble, next state in
+ *        the low one.
+ */
+#define NIGHTERM_VT(action, state)                                            \
+  (uint8_t)((NIGHTERM_VT_##action << 4) | NIGHTERM_VT_##state)
+
+/**
+ * @private
+ * @brief Transitions shared by every state: CAN and SUB abort, ESC starts
+ *        over and DEL is ignored.
+ */
+#define NIGHTERM_VT_ANYWHERE(state)                                           \
+  [NIGHTERM_VT_CAN] = NIGHTERM_VT(NONE, GROUND),                              \
+  [NIGHTERM_VT_ESC] = NIGHTERM_VT(CLEAR, ESCAPE),                             \
+  [NIGHTERM_VT_DEL] = NIGHTERM_VT(NONE, state)
+
+/**
+ * @private
+ * @brief Transitions of states inside a sequence: controls run in place
+ *        and bytes above 0x7F abort.
+ */
+#define NIGHTERM_VT_SEQUENCE(state)                                           \
+  NIGHTERM_VT_ANYWHERE(state),                                                \
+  [NIGHTERM_VT_C0] = NIGHTERM_VT(EXECUTE, state),                             \
+  [NIGHTERM_VT_BEL] = NIGHTERM_VT(EXECUTE, state),                            \
+  [NIGHTERM_VT_HIGH] = NIGHTERM_VT(NONE, GROUND)
+
+/**
+ * @private
+ * @brief Transition table, indexed by state and byte class.
+ */
+static const uint8_t
+  nighterm_vt_transitions[NIGHTERM_VT_STATES][NIGHTERM_VT_CLASSES] = {
+    [NIGHTERM_VT_GROUND] = {
+      NIGHTERM_VT_ANYWHERE(GROUND),
+      [NIGHTERM_VT_C0] = NIGHTERM_VT(EXECUTE, GROUND),
+      [NIGHTERM_VT_BEL] = NIGHTERM_VT(EXECUTE, GROUND),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(PRINT, GROUND),
+      [NIGHTERM_VT_HIGH] = NIGHTERM_VT(PRINT, GROUND),
+    },
+    [NIGHTERM_VT_ESCAPE] = {
+      NIGHTERM_VT_SEQUENCE(ESCAPE),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(COLLECT, ESCAPE_INTERMEDIATE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(CLEAR, CSI_ENTRY),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+    },
+    [NIGHTERM_VT_ESCAPE_INTERMEDIATE] = {
+      NIGHTERM_VT_SEQUENCE(ESCAPE_INTERMEDIATE),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(COLLECT, ESCAPE_INTERMEDIATE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(ESC_DISPATCH, GROUND),
+    },
+    [NIGHTERM_VT_CSI_ENTRY] = {
+      NIGHTERM_VT_SEQUENCE(CSI_ENTRY),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(COLLECT, CSI_INTERMEDIATE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(PARAM, CSI_PARAM),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(PARAM, CSI_PARAM),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(COLLECT, CSI_PARAM),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+    },
+    [NIGHTERM_VT_CSI_PARAM] = {
+      NIGHTERM_VT_SEQUENCE(CSI_PARAM),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(COLLECT, CSI_INTERMEDIATE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(PARAM, CSI_PARAM),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(PARAM, CSI_PARAM),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+    },
+    [NIGHTERM_VT_CSI_INTERMEDIATE] = {
+      NIGHTERM_VT_SEQUENCE(CSI_INTERMEDIATE),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(COLLECT, CSI_INTERMEDIATE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(CSI_DISPATCH, GROUND),
+    },
+    [NIGHTERM_VT_CSI_IGNORE] = {
+      NIGHTERM_VT_SEQUENCE(CSI_IGNORE),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(NONE, CSI_IGNORE),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(NONE, GROUND),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(NONE, GROUND),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(NONE, GROUND),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(NONE, GROUND),
+    },
+    [NIGHTERM_VT_STRING] = {
+      NIGHTERM_VT_ANYWHERE(STRING),
+      /* Strings end with BEL or ESC \, and swallow everything else. */
+      [NIGHTERM_VT_C0] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_BEL] = NIGHTERM_VT(NONE, GROUND),
+      [NIGHTERM_VT_INTERMEDIATE] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_DIGIT] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_SEPARATOR] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_PRIVATE] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_CSI] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_OSC] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_STRING_START] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_FINAL] = NIGHTERM_VT(NONE, STRING),
+      [NIGHTERM_VT_HIGH] = NIGHTERM_VT(NONE, STRING),
+    },
+  };
+
+#undef NIGHTERM_VT_SEQUENCE
+#undef NIGHTERM_VT_ANYWHERE
+#undef NIGHTERM_VT
+
+/**
+ * @private
+ * @brief Returns a numeric parameter of the current sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          index
+ *                 Index of the parameter
+ *
+ * @param          fallback
+ *                 Value of a missing or zero parameter
+ *
+ * @return         The parameter, or fallback.
+ */
+uint32_t
+nighterm_vt_param(struct nighterm_ctx *context,
+                  uint32_t index,
+                  uint32_t fallback)
+{
+  if (index >= context->vt_param_count || context->vt_params[index] == 0) {
+    return fallback;
+  }
+
+  return context->vt_params[index];
+}
+
+/**
+ * @private
+ * @brief Moves a pending wrap back onto the last column, before the
+ *        cursor is moved by a sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_vt_clamp_cursor(struct nighterm_ctx *context)
+{
+  if (context->cur_x >= context->cols) {
+    context->cur_x = context->cols ? context->cols - 1 : 0;
+  }
+  if (context->cur_y >= context->rows) {
+    context->cur_y = context->rows ? context->rows - 1 : 0;
+  }
+}
+
+/**
+ * @private
+ * @brief Draws printable ASCII characters at the cursor, wrapping at the
+ *        end of lines.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          chars
+ *                 Characters in the range 0x20-0x7E
+ *
+ * @param          count
+ *                 Amount of characters
+ */
+void
+nighterm_vt_print(struct nighterm_ctx *context, const char *chars, size_t count)
+{
+  if (context->cols == 0 || context->rows == 0) {
+    return;
+  }
+  if (context->cur_y >= context->rows) {
+    context->cur_y = context->rows - 1;
+  }
+
+  while (count > 0) {
+    if (context->cur_x >= context->cols) {
+      nighterm_newline(context);
+    }
+
+    uint32_t room = context->cols - context->cur_x;
+    uint32_t run = count < room ? (uint32_t)count : room;
+
+    nighterm_set_cells(context,
+                       context->cur_x,
+                       context->cur_y,
+                       chars,
+                       run,
+                       context->fg_color,
+                       context->bg_color);
+    context->cur_x += run;
+    chars += run;
+    count -= run;
+  }
+}
+
+/**
+ * @private
+ * @brief Draws a single character at the cursor.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          codepoint
+ *                 Unicode codepoint
+ */
+void
+nighterm_vt_put(struct nighterm_ctx *context, uint32_t codepoint)
+{
+  if (context->cols == 0) {
+    return;
+  }
+
+  if (context->cur_x >= context->cols) {
+    nighterm_newline(context);
+  }
+  nighterm_set_cell(context,
+                    context->cur_x,
+                    context->cur_y,
+                    codepoint,
+                    context->fg_color,
+                    context->bg_color);
+  context->cur_x++;
+}
+
+/**
+ * @private
+ * @brief Feeds a byte to the UTF-8 decoder, drawing every completed
+ *        codepoint. Malformed sequences draw U+FFFD.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          c
+ *                 Byte
+ *
+ * @return         Non-zero if the byte was consumed; zero if it is plain
+ *                 ASCII to be parsed as such.
+ */
+int
+nighterm_utf8_step(struct nighterm_ctx *context, uint8_t c)
+{
+  if (context->utf8_remaining != 0) {
+    if ((c & 0xC0) == 0x80) {
+      context->utf8_codepoint = (context->utf8_codepoint << 6) | (c & 0x3F);
+      if (--context->utf8_remaining != 0) {
+        return 1;
+      }
+
+      uint32_t codepoint = context->utf8_codepoint;
+      uint32_t min = context->utf8_length == 2   ? 0x80
+                     : context->utf8_length == 3 ? 0x800
+                                                 : 0x10000;
+      if (codepoint < min || codepoint > 0x10FFFF ||
+          (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+        codepoint = 0xFFFD;
+      }
+      nighterm_vt_put(context, codepoint);
+      return 1;
+    }
+
+    /* Truncated sequence; the byte starts something new. */
+    context->utf8_remaining = 0;
+    nighterm_vt_put(context, 0xFFFD);
+  }
+
+  if (c < 0x80) {
+    return 0;
+  }
+
+  if (c >= 0xC2 && c <= 0xDF) {
+    context->utf8_codepoint = c & 0x1F;
+    context->utf8_length = 2;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    context->utf8_codepoint = c & 0x0F;
+    context->utf8_length = 3;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    context->utf8_codepoint = c & 0x07;
+    context->utf8_length = 4;
+  } else {
+    nighterm_vt_put(context, 0xFFFD);
+    return 1;
+  }
+
+  context->utf8_remaining = context->utf8_length - 1;
+  return 1;
+}
+
+/**
+ * @private
+ * @brief Decodes one character of a complete UTF-8 string, with the same
+ *        rules as nighterm_utf8_step() but without touching the parser.
+ *
+ * @param          buf
+ *                 Pointer to the character
+ *
+ * @param          len
+ *                 Amount of bytes left in buf, at least 1
+ *
+ * @param ptr      codepoint
+ *                 Receives the codepoint, or U+FFFD if malformed
+ *
+ * @return         Amount of bytes consumed
+ */
+size_t
+nighterm_utf8_decode(const char *buf, size_t len, uint32_t *codepoint)
+{
+  uint8_t c = (uint8_t)buf[0];
+  uint32_t value;
+  size_t length;
+
+  if (c < 0x80) {
+    *codepoint = c;
+    return 1;
+  }
+
+  if (c >= 0xC2 && c <= 0xDF) {
+    value = c & 0x1F;
+    length = 2;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    value = c & 0x0F;
+    length = 3;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    value = c & 0x07;
+    length = 4;
+  } else {
+    *codepoint = 0xFFFD;
+    return 1;
+  }
+
+  for (size_t i = 1; i < length; i++) {
+    if (i >= len || ((uint8_t)buf[i] & 0xC0) != 0x80) {
+      /* Truncated sequence; the byte starts something new. */
+      *codepoint = 0xFFFD;
+      return i;
+    }
+    value = (value << 6) | ((uint8_t)buf[i] & 0x3F);
+  }
+
+  uint32_t min = length == 2 ? 0x80 : length == 3 ? 0x800 : 0x10000;
+  if (value < min || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) {
+    value = 0xFFFD;
+  }
+
+  *codepoint = value;
+  return length;
+}
+
+/**
+ * @private
+ * @brief Runs a control character.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          c
+ *                 Control character
+ */
+void
+nighterm_vt_execute(struct nighterm_ctx *context, uint8_t c)
+{
+  switch (c) {
+    case '\n':
+    case '\v':
+    case '\f':
+      nighterm_newline(context);
+      break;
+    case '\r':
+      context->cur_x = 0;
+      break;
+    case '\t':
+      /* Next tab stop, but never past the last column. */
+      context->cur_x += NIGHTERM_INDENT_WIDTH -
+                        context->cur_x % NIGHTERM_INDENT_WIDTH;
+      if (context->cols > 0 && context->cur_x >= context->cols) {
+        context->cur_x = context->cols - 1;
+      }
+      break;
+    case '\b':
+      nighterm_vt_clamp_cursor(context);
+      if (context->cur_x > 0) {
+        context->cur_x -= 1;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @private
+ * @brief Parses the arguments of an extended SGR color, 38 or 48: either
+ *        5;index into the palette or 2;r;g;b.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          index
+ *                 Index of the 38 or 48 parameter, advanced past the
+ *                 arguments
+ *
+ * @param          color
+ *                 Receives the SGR color
+ *
+ * @return         Non-zero if the arguments are complete and in range
+ */
+int
+nighterm_vt_sgr_extended(struct nighterm_ctx *context,
+                         uint32_t *index,
+                         uint32_t *color)
+{
+  uint32_t i = *index;
+  uint32_t mode = nighterm_vt_param(context, i + 1, 0);
+
+  if (mode == 5) {
+    uint32_t entry = nighterm_vt_param(context, i + 2, 0);
+    *index = i + 2;
+    if (i + 2 >= context->vt_param_count || entry >= NIGHTERM_PALETTE_SIZE) {
+      return 0;
+    }
+    *color = entry;
+    return 1;
+  }
+
+  if (mode == 2) {
+    uint32_t r = nighterm_vt_param(context, i + 2, 0);
+    uint32_t g = nighterm_vt_param(context, i + 3, 0);
+    uint32_t b = nighterm_vt_param(context, i + 4, 0);
+    *index = i + 4;
+    if (i + 4 >= context->vt_param_count || r > 0xFF || g > 0xFF ||
+        b > 0xFF) {
+      return 0;
+    }
+    *color = NIGHTERM_SGR_RGB | r << 16 | g << 8 | b;
+    return 1;
+  }
+
+  /* An unknown mode leaves the rest of the sequence alone. */
+  return 0;
+}
+
+/**
+ * @private
+ * @brief Applies an SGR (select graphic rendition) sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_vt_sgr(struct nighterm_ctx *context)
+{
+  uint32_t count = context->vt_param_count ? context->vt_param_count : 1;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t param = nighterm_vt_param(context, i, 0);
+
+    if (param == 0) {
+      context->sgr_fg = NIGHTERM_SGR_DEFAULT;
+      context->sgr_bg = NIGHTERM_SGR_DEFAULT;
+      context->sgr_flags = 0;
+    } else if (param == 1) {
+      context->sgr_flags |= NIGHTERM_SGR_BOLD;
+    } else if (param == 22) {
+      context->sgr_flags &= (uint8_t)~NIGHTERM_SGR_BOLD;
+    } else if (param == 7) {
+      context->sgr_flags |= NIGHTERM_SGR_REVERSE;
+    } else if (param == 27) {
+      context->sgr_flags &= (uint8_t)~NIGHTERM_SGR_REVERSE;
+    } else if (param >= 30 && param <= 37) {
+      context->sgr_fg = param - 30;
+    } else if (param == 39) {
+      context->sgr_fg = NIGHTERM_SGR_DEFAULT;
+    } else if (param >= 40 && param <= 47) {
+      context->sgr_bg = param - 40;
+    } else if (param == 49) {
+      context->sgr_bg = NIGHTERM_SGR_DEFAULT;
+    } else if (param >= 90 && param <= 97) {
+      context->sgr_fg = param - 90 + 8;
+    } else if (param >= 100 && param <= 107) {
+      context->sgr_bg = param - 100 + 8;
+    } else if (param == 38 || param == 48) {
+      uint32_t color;
+      if (!nighterm_vt_sgr_extended(context, &i, &color)) {
+        continue;
+      }
+      if (param == 38) {
+        context->sgr_fg = color;
+      } else {
+        context->sgr_bg = color;
+      }
+    }
+  }
+
+  nighterm_update_pen(context);
+}
+
+/**
+ * @private
+ * @brief Runs an ED (erase in display) or EL (erase in line) sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          display
+ *                 Non-zero for ED, zero for EL
+ */
+void
+nighterm_vt_erase(struct nighterm_ctx *context, int display)
+{
+  uint32_t mode = nighterm_vt_param(context, 0, 0);
+  uint32_t col = context->cur_x;
+  uint32_t row = context->cur_y;
+
+  if (mode == 0) {
+    nighterm_erase_cells(context, row, col, context->cols);
+    for (row++; display && row < context->rows; row++) {
+      nighterm_erase_cells(context, row, 0, context->cols);
+    }
+  } else if (mode == 1) {
+    nighterm_erase_cells(context, row, 0, col + 1);
+    while (display && row-- > 0) {
+      nighterm_erase_cells(context, row, 0, context->cols);
+    }
+  } else if (mode == 3 && display) {
+    /* As in xterm, ED 3 erases the scrollback and keeps the screen. The
+     * view is live, since parsing left it. */
+    struct nighterm_history *history = &context->history;
+    history->tail = history->head;
+    history->used = 0;
+    history->lines = 0;
+    history->view_top = history->head;
+  } else if (mode == 2 || mode == 3) {
+    uint32_t first = display ? 0 : row;
+    uint32_t end = display ? context->rows : row + 1;
+    for (row = first; row < end; row++) {
+      nighterm_erase_cells(context, row, 0, context->cols);
+    }
+  }
+}
+
+/**
+ * @private
+ * @brief Runs a CSI sequence with a private marker or an intermediate
+ *        byte. Of those, only the cursor ones are supported: DECTCEM
+ *        (CSI ? 25 h and l) shows and hides the cursor, DECSCUSR
+ *        (CSI Ps SP q) selects its style.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          final
+ *                 Final byte of the sequence
+ */
+void
+nighterm_vt_csi_cursor(struct nighterm_ctx *context, uint8_t final)
+{
+  if (context->vt_private == '?' && context->vt_intermediate == 0 &&
+      (final == 'h' || final == 'l')) {
+    for (uint32_t i = 0; i < context->vt_param_count; i++) {
+      if (context->vt_params[i] != 25) {
+        continue;
+      }
+      if (final == 'h') {
+        context->cursor_flags |= NIGHTERM_CURSOR_VISIBLE;
+      } else {
+        context->cursor_flags &= (uint8_t)~NIGHTERM_CURSOR_VISIBLE;
+      }
+    }
+    return;
+  }
+
+  if (context->vt_private == 0 && context->vt_intermediate == ' ' &&
+      final == 'q') {
+    /* 0 and 1 blinking block, 2 block, 3 blinking underline, 4 underline,
+     * 5 blinking bar, 6 bar. */
+    uint32_t shape = nighterm_vt_param(context, 0, 0);
+    if (shape > 6) {
+      return;
+    }
+    nighterm_hide_cursor(context);
+    context->cursor_style = shape <= 2   ? NIGHTERM_CURSOR_BLOCK
+                            : shape <= 4 ? NIGHTERM_CURSOR_UNDERLINE
+                                         : NIGHTERM_CURSOR_BAR;
+    if (shape == 0 || shape % 2 == 1) {
+      context->cursor_flags |= NIGHTERM_CURSOR_BLINK;
+    } else {
+      context->cursor_flags &= (uint8_t)~NIGHTERM_CURSOR_BLINK;
+      context->cursor_blink_off = 0;
+    }
+  }
+}
+
+/**
+ * @private
+ * @brief Runs a complete CSI sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          final
+ *                 Final byte of the sequence
+ */
+void
+nighterm_vt_csi_dispatch(struct nighterm_ctx *context, uint8_t final)
+{
+  if (context->rows == 0) {
+    return;
+  }
+
+  if (context->vt_private != 0 || context->vt_intermediate != 0) {
+    nighterm_vt_csi_cursor(context, final);
+    return;
+  }
+
+  uint32_t n = nighterm_vt_param(context, 0, 1);
+  uint32_t last_col = context->cols - 1;
+  uint32_t last_row = context->rows - 1;
+
+  if (final == 'm') {
+    nighterm_vt_sgr(context);
+    return;
+  }
+
+  nighterm_vt_clamp_cursor(context);
+
+  /* Vertical movement stops at the margins of the scroll region, unless
+   * the cursor is outside of it already. */
+  uint32_t top = context->cur_y >= context->scroll_top ? context->scroll_top
+                                                        : 0;
+  uint32_t bottom = context->cur_y < context->scroll_bottom
+                      ? context->scroll_bottom - 1
+                      : last_row;
+
+  switch (final) {
+    case 'A':
+      context->cur_y -= n < context->cur_y - top ? n : context->cur_y - top;
+      break;
+    case 'B':
+    case 'e':
+      context->cur_y = n < bottom - context->cur_y ? context->cur_y + n
+                                                    : bottom;
+      break;
+    case 'C':
+    case 'a':
+      context->cur_x = n < last_col - context->cur_x ? context->cur_x + n
+                                                      : last_col;
+      break;
+    case 'D':
+      context->cur_x -= n < context->cur_x ? n : context->cur_x;
+      break;
+    case 'E':
+      context->cur_y = n < bottom - context->cur_y ? context->cur_y + n
+                                                    : bottom;
+      context->cur_x = 0;
+      break;
+    case 'F':
+      context->cur_y -= n < context->cur_y - top ? n : context->cur_y - top;
+      context->cur_x = 0;
+      break;
+    case 'G':
+    case '`':
+      context->cur_x = n - 1 < last_col ? n - 1 : last_col;
+      break;
+    case 'd':
+      context->cur_y = n - 1 < last_row ? n - 1 : last_row;
+      break;
+    case 'H':
+    case 'f': {
+      uint32_t col = nighterm_vt_param(context, 1, 1);
+      context->cur_y = n - 1 < last_row ? n - 1 : last_row;
+      context->cur_x = col - 1 < last_col ? col - 1 : last_col;
+      break;
+    }
+    case 'J':
+      nighterm_vt_erase(context, 1);
+      break;
+    case 'K':
+      nighterm_vt_erase(context, 0);
+      break;
+    case 'L':
+    case 'M':
+      /* IL and DL only work inside the scroll region. */
+      if (context->cur_y >= context->scroll_top &&
+          context->cur_y < context->scroll_bottom) {
+        nighterm_move_rows(context,
+                           context->cur_y,
+                           context->scroll_bottom,
+                           n,
+                           final == 'M');
+        context->cur_x = 0;
+      }
+      break;
+    case '@':
+    case 'P':
+      nighterm_shift_cells(
+        context, context->cur_y, context->cur_x, n, final == '@');
+      break;
+    case 'X':
+      nighterm_erase_cells(
+        context, context->cur_y, context->cur_x, context->cur_x + n);
+      break;
+    case 'S':
+      nighterm_scroll_up(context, n);
+      break;
+    case 'T':
+      nighterm_move_rows(
+        context, context->scroll_top, context->scroll_bottom, n, 0);
+      break;
+    case 'r': {
+      /* DECSTBM; the region needs at least two lines. */
+      uint32_t region_bottom = nighterm_vt_param(context, 1, context->rows);
+      if (region_bottom > context->rows) {
+        region_bottom = context->rows;
+      }
+      if (n < region_bottom) {
+        context->scroll_top = n - 1;
+        context->scroll_bottom = region_bottom;
+        context->cur_x = 0;
+        context->cur_y = 0;
+      }
+      break;
+    }
+    case 's':
+      context->saved_x = context->cur_x;
+      context->saved_y = context->cur_y;
+      break;
+    case 'u':
+      context->cur_x = context->saved_x;
+      context->cur_y = context->saved_y;
+      nighterm_vt_clamp_cursor(context);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @private
+ * @brief Runs a complete escape sequence.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          final
+ *                 Final byte of the sequence
+ */
+void
+nighterm_vt_esc_dispatch(struct nighterm_ctx *context, uint8_t final)
+{
+  if (context->vt_intermediate != 0) {
+    /* Character set selection and friends; ignored. */
+    return;
+  }
+
+  switch (final) {
+    case '7':
+      context->saved_x = context->cur_x;
+      context->saved_y = context->cur_y;
+      break;
+    case '8':
+      context->cur_x = context->saved_x;
+      context->cur_y = context->saved_y;
+      nighterm_vt_clamp_cursor(context);
+      break;
+    case 'E':
+      nighterm_newline(context);
+      break;
+    case 'D':
+      nighterm_linefeed(context);
+      break;
+    case 'M':
+      /* Reverse index scrolls down at the top of the scroll region. */
+      nighterm_vt_clamp_cursor(context);
+      if (context->cur_y == context->scroll_top) {
+        nighterm_move_rows(
+          context, context->scroll_top, context->scroll_bottom, 1, 0);
+      } else if (context->cur_y > 0) {
+        context->cur_y--;
+      }
+      break;
+    case 'c':
+      /* Full reset. */
+      context->sgr_fg = NIGHTERM_SGR_DEFAULT;
+      context->sgr_bg = NIGHTERM_SGR_DEFAULT;
+      context->sgr_flags = 0;
+      nighterm_update_pen(context);
+      for (uint32_t row = 0; row < context->rows; row++) {
+        nighterm_erase_cells(context, row, 0, context->cols);
+      }
+      context->cur_x = 0;
+      context->cur_y = 0;
+      context->saved_x = 0;
+      context->saved_y = 0;
+      context->scroll_top = 0;
+      context->scroll_bottom = context->rows;
+      context->cursor_flags |= NIGHTERM_CURSOR_VISIBLE;
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @private
+ * @brief Feeds a single byte to the parser.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          c
+ *                 Byte
+ */
+void
+nighterm_vt_step(struct nighterm_ctx *context, uint8_t c)
+{
+  uint8_t transition =
+    nighterm_vt_transitions[context->vt_state][nighterm_vt_classes[c]];
+
+  context->vt_state = transition & 0x0F;
+
+  switch (transition >> 4) {
+    case NIGHTERM_VT_PRINT:
+      nighterm_vt_put(context, c);
+      break;
+    case NIGHTERM_VT_EXECUTE:
+      nighterm_vt_execute(context, c);
+      break;
+    case NIGHTERM_VT_CLEAR:
+      context->vt_private = 0;
+      context->vt_intermediate = 0;
+      context->vt_param_count = 0;
+      break;
+    case NIGHTERM_VT_COLLECT:
+      if (c >= 0x3C) {
+        context->vt_private = c;
+      } else {
+        context->vt_intermediate = c;
+      }
+      break;
+    case NIGHTERM_VT_PARAM: {
+      if (context->vt_param_count == 0) {
+        context->vt_params[0] = 0;
+        context->vt_param_count = 1;
+      }
+      uint16_t *param = &context->vt_params[context->vt_param_count - 1];
+      if (c >= '0' && c <= '9') {
+        uint32_t value = *param * 10u + (uint32_t)(c - '0');
+        *param = value > 0xFFFF ? 0xFFFF : (uint16_t)value;
+      } else if (context->vt_param_count < NIGHTERM_VT_MAX_PARAMS) {
+        context->vt_params[context->vt_param_count++] = 0;
+      }
+      break;
+    }
+    case NIGHTERM_VT_ESC_DISPATCH:
+      nighterm_vt_esc_dispatch(context, c);
+      break;
+    case NIGHTERM_VT_CSI_DISPATCH:
+      nighterm_vt_csi_dispatch(context, c);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @private
+ * @brief Parses a buffer of characters and updates the character grid,
+ *        without rendering or flushing it.
+ *
+ * Runs of printable ASCII in the ground state skip the state machine and
+ * the UTF-8 decoder, and are stored a line at a time. Other bytes above
+ * 0x7F in the ground state are decoded as UTF-8.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          buf
+ *                 Characters to be parsed
+ *
+ * @param          len
+ *                 Amount of characters in buf
+ */
+void
+nighterm_parse(struct nighterm_ctx *context, const char *buf, size_t len)
+{
+  NIGHTERM_STAT_ADD(context, chars_written, len);
+
+  /* New output returns to the live screen. */
+  nighterm_leave_view(context);
+
+  size_t i = 0;
+  while (i < len) {
+    if (context->vt_state == NIGHTERM_VT_GROUND) {
+      if (context->utf8_remaining == 0) {
+        size_t run = nighterm_ascii_run(buf + i, len - i);
+        if (run > 0) {
+          nighterm_vt_print(context, buf + i, run);
+          i += run;
+          continue;
+        }
+      }
+
+      if (nighterm_utf8_step(context, (uint8_t)buf[i])) {
+        i++;
+        continue;
+      }
+    }
+
+    nighterm_vt_step(context, (uint8_t)buf[i++]);
+  }
+}
+
+/**
+ * @private
+ * @brief Copies the damaged parts of the backbuffer to the framebuffer
+ *        and marks them as clean.
+ *
+ * When the host flips pages, the damage of the previous frame is copied
+ * as well, since the back page missed it, and the page is flipped after
+ * the copy. When the host pans, the scanout offset is updated after the
+ * copy. Margins outside of a text area backbuffer are filled with the
+ * border color, and without a backbuffer nothing is copied.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_flush_backbuffer(struct nighterm_ctx *context)
+{
+  if (context->damage_first > context->damage_last) {
+    return;
+  }
+
+  NIGHTERM_STAT_START(context);
+  NIGHTERM_STAT_ADD(context, flushes, 1);
+
+  uint64_t bytes_per_pixel = context->fb_bytes_per_pixel;
+  int flipping = context->hooks.flip_page != NULL;
+  uint8_t *vram =
+    (uint8_t *)context->fb_addr + context->pan_y * context->fb_pitch;
+  uint32_t first = flipping ? 0 : context->damage_first;
+  uint32_t last = flipping ? context->bands - 1 : context->damage_last;
+
+  for (uint32_t band = first; band <= last && band < context->bands; band++) {
+    struct nighterm_span span = context->damage[band];
+
+    if (flipping) {
+      struct nighterm_span stale = context->flip_damage[band];
+      context->flip_damage[band] = span;
+      if (stale.x0 < span.x0) {
+        span.x0 = stale.x0;
+      }
+      if (stale.x1 > span.x1) {
+        span.x1 = stale.x1;
+      }
+    }
+
+    context->damage[band].x0 = (uint32_t)context->fb_width;
+    context->damage[band].x1 = 0;
+
+    if (span.x0 >= span.x1 ||
+        context->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE) {
+      continue;
+    }
+
+    uint64_t y = (uint64_t)band * context->cell_height;
+    uint64_t y_end = band + 1 == context->bands ? context->fb_height
+                                                 : y + context->cell_height;
+    if (y_end > context->fb_height) {
+      y_end = context->fb_height;
+    }
+
+    /* Columns [span.x0, copy_end) come from the backbuffer, the rest is
+     * margin. */
+    uint64_t copy_end = span.x1 < context->backbuffer_width
+                          ? span.x1
+                          : context->backbuffer_width;
+    if (y >= context->backbuffer_height || copy_end < span.x0) {
+      copy_end = span.x0;
+    }
+    uint64_t offset = span.x0 * bytes_per_pixel;
+    uint64_t length = (copy_end - span.x0) * bytes_per_pixel;
+    uint64_t border = span.x1 - copy_end;
+    uint8_t *src = length ? nighterm_backbuffer_line(context, y) + offset : NULL;
+
+    for (uint64_t line = y; line < y_end; line++) {
+      uint8_t *dest = vram + line * context->fb_pitch + offset;
+      if (length) {
+        nighterm_memcpy_vram(dest, src, length);
+        src += context->backbuffer_pitch;
+      }
+      if (border) {
+        context->fill_span(dest + length, context->border_color, border);
+      }
+    }
+    NIGHTERM_STAT_ADD(context,
+                      vram_bytes,
+                      (y_end - y) * (span.x1 - span.x0) * bytes_per_pixel);
+  }
+
+  context->damage_first = context->bands;
+  context->damage_last = 0;
+
+  nighterm_vram_fence();
+
+  if (flipping) {
+    void *next = context->hooks.flip_page(context->hooks.user);
+    if (next != NULL) {
+      context->fb_addr = next;
+    }
+  } else if (context->pan_y != context->scanout_y &&
+             context->hooks.set_scanout_offset != NULL) {
+    context->hooks.set_scanout_offset(context->hooks.user, context->pan_y);
+    context->scanout_y = context->pan_y;
+  }
+
+  NIGHTERM_STAT_STOP(context, flush_time);
+}
+
+/**
+ * @private
+ * @brief Draws and flushes all changes, unless presentation is deferred
+ *        to nighterm_present().
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_update(struct nighterm_ctx *context)
+{
+  if (context->present_mode == NIGHTERM_PRESENT_DEFERRED) {
+    return;
+  }
+
+  nighterm_render(context);
+  nighterm_flush_backbuffer(context);
+}
+
+/**
+ * @private
+ * @brief Copies a terminal name, truncating it to
+ *        NIGHTERM_TERMINAL_NAME_SIZE - 1 characters.
+ *
+ * @param          dest
+ *                 Name buffer of a terminal
+ *
+ * @param optional name
+ *                 Name; NULL for an empty one
+ */
+void
+nighterm_copy_name(char *dest, const char *name)
+{
+  uint32_t i = 0;
+
+  for (; name != NULL && name[i] != 0 && i + 1 < NIGHTERM_TERMINAL_NAME_SIZE;
+       i++) {
+    dest[i] = name[i];
+  }
+  for (; i < NIGHTERM_TERMINAL_NAME_SIZE; i++) {
+    dest[i] = 0;
+  }
+}
+
+/**
+ * @private
+ * @brief Swaps the terminal state held by the context with a terminal
+ *        record.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          terminal
+ *                 Terminal record
+ */
+void
+nighterm_exchange_terminal(struct nighterm_ctx *context,
+                           struct nighterm_terminal *terminal)
+{
+#define NIGHTERM_EXCHANGE(field)                                              \
+  do {                                                                        \
+    __typeof__(context->field) tmp = context->field;                          \
+    context->field = terminal->field;                                         \
+    terminal->field = tmp;                                                    \
+  } while (0)
+
+  NIGHTERM_EXCHANGE(font);
+  NIGHTERM_EXCHANGE(font_size);
+  NIGHTERM_EXCHANGE(cells);
+  NIGHTERM_EXCHANGE(row_origin);
+  NIGHTERM_EXCHANGE(history);
+  NIGHTERM_EXCHANGE(cur_x);
+  NIGHTERM_EXCHANGE(cur_y);
+  NIGHTERM_EXCHANGE(saved_x);
+  NIGHTERM_EXCHANGE(saved_y);
+  NIGHTERM_EXCHANGE(scroll_top);
+  NIGHTERM_EXCHANGE(scroll_bottom);
+  NIGHTERM_EXCHANGE(cursor_style);
+  NIGHTERM_EXCHANGE(cursor_flags);
+  NIGHTERM_EXCHANGE(vt_state);
+  NIGHTERM_EXCHANGE(vt_private);
+  NIGHTERM_EXCHANGE(vt_intermediate);
+  NIGHTERM_EXCHANGE(vt_param_count);
+  for (uint32_t i = 0; i < NIGHTERM_VT_MAX_PARAMS; i++) {
+    NIGHTERM_EXCHANGE(vt_params[i]);
+  }
+  NIGHTERM_EXCHANGE(utf8_codepoint);
+  NIGHTERM_EXCHANGE(utf8_length);
+  NIGHTERM_EXCHANGE(utf8_remaining);
+  NIGHTERM_EXCHANGE(default_fg);
+  NIGHTERM_EXCHANGE(default_bg);
+  NIGHTERM_EXCHANGE(sgr_fg);
+  NIGHTERM_EXCHANGE(sgr_bg);
+  NIGHTERM_EXCHANGE(sgr_flags);
+  NIGHTERM_EXCHANGE(fg_color);
+  NIGHTERM_EXCHANGE(bg_color);
+
+#undef NIGHTERM_EXCHANGE
+}
+
+/**
+ * @private
+ * @brief Resizes the grids of background terminals after the active
+ *        terminal changed to a font of another size, and switches them to
+ *        that font.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          old_cols
+ *                 Amount of columns of the old grids
+ *
+ * @param          old_rows
+ *                 Amount of rows of the old grids
+ *
+ * @return         NIGHTERM_SUCCESS if all grids were resized;
+ *                 NIGHTERM_NO_MORE_MEMORY if some terminals could not be
+ *                 resized and were closed.
+ */
+int
+nighterm_resize_terminals(struct nighterm_ctx *context,
+                          uint32_t old_cols,
+                          uint32_t old_rows)
+{
+  int status = NIGHTERM_SUCCESS;
+
+  for (uint32_t t = 0; t < NIGHTERM_MAX_TERMINALS; t++) {
+    struct nighterm_terminal *terminal = &context->terminals[t];
+    if (!terminal->used || t == context->active_terminal) {
+      continue;
+    }
+
+    /* Unroll the ring so the grid starts at its top row again. */
+    uint64_t total = (uint64_t)old_rows * old_cols;
+    uint64_t head = (uint64_t)terminal->row_origin * old_cols;
+    nighterm_reverse_cells(terminal->cells, head);
+    nighterm_reverse_cells(terminal->cells + head, total - head);
+    nighterm_reverse_cells(terminal->cells, total);
+    terminal->row_origin = 0;
+
+    struct nighterm_cell blank = { ' ', terminal->fg_color, terminal->bg_color };
+    struct nighterm_cell *cells = terminal->cells;
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+    cells = (struct nighterm_cell *)context->malloc(
+      (size_t)context->rows * context->cols * sizeof(struct nighterm_cell));
+    if (cells == NULL) {
+      context->free(terminal->cells);
+      *terminal = (struct nighterm_terminal){ 0 };
+      status = NIGHTERM_NO_MORE_MEMORY;
+      continue;
+    }
+#endif
+
+    nighterm_relayout_cells(blank,
+                            cells,
+                            terminal->cells,
+                            old_cols,
+                            old_rows,
+                            context->cols,
+                            context->rows);
+
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+    context->free(terminal->cells);
+#endif
+    terminal->cells = cells;
+    terminal->font = context->font;
+    terminal->font_size = context->font_size;
+    if (terminal->cur_x > context->cols) {
+      terminal->cur_x = context->cols;
+    }
+    terminal->scroll_top = 0;
+    terminal->scroll_bottom = context->rows;
+    if (terminal->cur_y >= context->rows) {
+      terminal->cur_y = context->rows ? context->rows - 1 : 0;
+    }
+  }
+
+  return status;
+}
+
+/**
+ * @brief Initializes Nighterm terminals and configuration.
+ *
+ * @param          config
+ *                 Pointer to a new context structure.
+ *
+ * @param optional font
+ *                 Pointer to a font buffer. If NULL, default font is used.
+ *
+ * @param          font_size
+ *                 Size of the font buffer in bytes; ignored without a font
+ *
+ * @param          framebuffer_addr
+ *                 Framebuffer address
+ *
+ * @param          framebuffer_width
+ *                 Framebuffer width in pixels
+ *
+ * @param          framebuffer_height
+ *                 Framebuffer height in pixelss
+ *
+ * @param          framebuffer_bpp
+ *                 Framebuffer's Bits per Pixel
+ *
+ * @param optional custom_malloc
+ *                 Pointer to a malloc() function
+ *                 provided by the host OS
+ *
+ * @param optional custom_free
+ *                 Pointer to a free() function
+ *                 provided by the host OS
+ *
+ * @param optional hooks
+ *                 Host callbacks for panning and page flipping, see
+ *                 struct nighterm_hooks. Copied into the context.
+ *
+ * @return         NIGHTERM_SUCCESS if the initialization was successful;
+ *                 error code otherwise. All error codes are defined in
+ *                 nighterm.h.
+ */
+int
+nighterm_initialize(struct nighterm_ctx *config,
+                    void *font,
+                    uint64_t font_size,
+                    void *framebuffer_addr,
+                    uint64_t framebuffer_width,
+                    uint64_t framebuffer_height,
+                    uint16_t framebuffer_bpp,
+                    nighterm_malloc custom_malloc,
+                    nighterm_free custom_free,
+                    const struct nighterm_hooks *hooks)
+{
+  if (font == NULL) {
+    /* No font supplied. */
+    font = &nighterm_default_font;
+    font_size = sizeof(nighterm_default_font);
+  }
+
+  if (framebuffer_addr == NULL) {
+    /* No framebuffer specified, or invalid address. */
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  if (framebuffer_width < 1 || framebuffer_height < 1) {
+    /* Invalid framebuffer dimensions. */
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  if (framebuffer_bpp < 1) {
+    /* Invalid framebuffer bpp. */
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  config->fb_addr = framebuffer_addr;
+  config->fb_width = framebuffer_width;
+  config->fb_height = framebuffer_height;
+  config->fb_bytes_per_pixel = (framebuffer_bpp + 7) >> 3;
+  config->fb_pitch = framebuffer_width * config->fb_bytes_per_pixel;
+  config->fb_bpp = framebuffer_bpp;
+
+  /* Common layouts; hosts with other masks call nighterm_set_pixel_format(). */
+  int status;
+  if (framebuffer_bpp == 16) {
+    status = nighterm_setup_format(config, 5, 11, 6, 5, 5, 0);
+  } else if (framebuffer_bpp == 15) {
+    status = nighterm_setup_format(config, 5, 10, 5, 5, 5, 0);
+  } else if (framebuffer_bpp == 8) {
+    status = nighterm_setup_format(config, 3, 5, 3, 2, 2, 0);
+  } else {
+    status = nighterm_setup_format(config, 8, 16, 8, 8, 8, 0);
+  }
+  if (status != NIGHTERM_SUCCESS) {
+    return status;
+  }
+
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  if (custom_malloc == NULL || custom_free == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+  config->malloc = custom_malloc;
+  config->free = custom_free;
+#else
+  (void)custom_malloc;
+  (void)custom_free;
+  config->malloc = NULL;
+  config->free = NULL;
+#endif
+
+  config->cur_x = 0;
+  config->cur_y = 0;
+  config->rows = 0;
+  config->cols = 0;
+  config->row_origin = 0;
+  config->pan_y = 0;
+  config->scanout_y = 0;
+  config->present_mode = NIGHTERM_PRESENT_IMMEDIATE;
+  config->frame_interval = 0;
+  config->last_present = 0;
+#ifdef NIGHTERM_ENABLE_STATS
+  config->stats = (struct nighterm_stats){ 0 };
+#endif
+
+  if (hooks != NULL) {
+    config->hooks = *hooks;
+  } else {
+    config->hooks = (struct nighterm_hooks){ 0 };
+  }
+
+  /* The backbuffer itself is sized by nighterm_load_font(). */
+  config->backbuffer_mode = config->hooks.backbuffer_mode;
+  config->backbuffer = (uint8_t *)config->hooks.backbuffer;
+  config->backbuffer_size = config->hooks.backbuffer_size;
+  config->backbuffer_owned = 0;
+  config->border_color = 0;
+  if (config->backbuffer_mode > NIGHTERM_BACKBUFFER_NONE) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+  if (config->backbuffer == NULL) {
+    config->backbuffer_size = 0;
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+    config->backbuffer_owned =
+      config->backbuffer_mode != NIGHTERM_BACKBUFFER_NONE;
+#else
+    if (config->backbuffer_mode == NIGHTERM_BACKBUFFER_TEXT) {
+      return NIGHTERM_INVALID_PARAMETER;
+    }
+    config->backbuffer_mode = NIGHTERM_BACKBUFFER_NONE;
+#endif
+  }
+  if (config->backbuffer_mode == NIGHTERM_BACKBUFFER_NONE &&
+      config->hooks.flip_page != NULL) {
+    /* The back page would miss everything drawn into the front one. */
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+  config->saved_x = 0;
+  config->saved_y = 0;
+  config->vt_state = NIGHTERM_VT_GROUND;
+  config->vt_private = 0;
+  config->vt_intermediate = 0;
+  config->vt_param_count = 0;
+  config->utf8_remaining = 0;
+
+  nighterm_build_palette(config);
+  config->default_fg = nighterm_pack_color(config, 0xFF, 0xFF, 0xFF);
+  config->default_bg = nighterm_pack_color(config, 0x00, 0x00, 0x00);
+  config->sgr_fg = NIGHTERM_SGR_DEFAULT;
+  config->sgr_bg = NIGHTERM_SGR_DEFAULT;
+  config->sgr_flags = 0;
+  nighterm_update_pen(config);
+
+  config->cursor_style = NIGHTERM_CURSOR_UNDERLINE;
+  config->cursor_flags = 0;
+  config->cursor_drawn = 0;
+  config->cursor_blink_off = 0;
+
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  config->damage = NULL;
+  config->glyph_pixels = NULL;
+  config->cells = NULL;
+  config->dirty = NULL;
+  config->flip_damage = NULL;
+  config->ring = (uint32_t *)config->malloc(NIGHTERM_RING_SIZE);
+  config->history.data = (uint8_t *)config->malloc(NIGHTERM_SCROLLBACK_SIZE);
+  config->history.mask = NIGHTERM_SCROLLBACK_SIZE - 1;
+  if (config->ring == NULL || config->history.data == NULL) {
+    nighterm_release(config, config->ring);
+    nighterm_release(config, config->history.data);
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+#else
+  config->cells = config->cell_storage;
+
+  /* The arena is masked, so only a power of two of the storage is used. */
+  uint64_t scrollback_size = config->hooks.scrollback_size;
+  if (scrollback_size > 0x80000000u) {
+    scrollback_size = 0x80000000u;
+  }
+  while (scrollback_size & (scrollback_size - 1)) {
+    scrollback_size &= scrollback_size - 1;
+  }
+  config->history.data =
+    scrollback_size ? (uint8_t *)config->hooks.scrollback : NULL;
+  config->history.mask = (uint32_t)(scrollback_size - 1);
+#endif
+  config->history.head = 0;
+  config->history.tail = 0;
+  config->history.used = 0;
+  config->history.lines = 0;
+  config->history.view = 0;
+  config->history.view_top = 0;
+
+  for (uint32_t i = 0; i < NIGHTERM_MAX_TERMINALS; i++) {
+    config->terminals[i] = (struct nighterm_terminal){ 0 };
+  }
+  nighterm_copy_name(config->terminals[0].name, "console");
+  config->terminals[0].used = 1;
+  config->active_terminal = 0;
+  config->background = 0;
+
+  /* Zeroed records read as not yet committed. */
+  nighterm_memset32(config->ring, 0, NIGHTERM_RING_SIZE / 4);
+  config->ring_head = 0;
+  config->ring_tail = 0;
+  config->ring_dropped = 0;
+
+  status = nighterm_load_font(config, font, font_size);
+  if (status != NIGHTERM_SUCCESS) {
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+    /* A failed load leaves the grid and glyph cache unallocated. */
+    nighterm_release(config, config->ring);
+    nighterm_release(config, config->history.data);
+    config->ring = NULL;
+    config->history.data = NULL;
+#endif
+    return status;
+  }
+
+  /* Start from a blank backbuffer, but leave the screen untouched. The
+   * cursor shows up with the first update. */
+  nighterm_render(config);
+  nighterm_reset_damage(config);
+  config->cursor_flags = NIGHTERM_CURSOR_VISIBLE | NIGHTERM_CURSOR_BLINK;
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Frees all allocated memory and deinitializes Nighterm.
+ *
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+int
+nighterm_shutdown(struct nighterm_ctx *context)
+{
+  if (context == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  context->fb_addr = 0;
+  context->fb_width = 0;
+  context->fb_height = 0;
+  context->fb_pitch = 0;
+  context->fb_bpp = 0;
+  context->fb_bytes_per_pixel = 0;
+  context->rows = 0;
+  context->cols = 0;
+  context->cur_x = 0;
+  context->cur_y = 0;
+  context->cell_width = 0;
+  context->cell_height = 0;
+  context->bands = 0;
+  context->fg_color = 0;
+  context->bg_color = 0;
+  context->font_size = 0;
+  context->font_data = NULL;
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  if (context->backbuffer_owned) {
+    nighterm_release(context, context->backbuffer);
+  }
+  context->free(context->damage);
+  context->free(context->glyph_pixels);
+  context->free(context->cells);
+  context->free(context->dirty);
+  context->free(context->flip_damage);
+  context->free(context->ring);
+  context->ring = NULL;
+  nighterm_release(context, context->history.data);
+  for (uint32_t i = 0; i < NIGHTERM_MAX_TERMINALS; i++) {
+    if (i != context->active_terminal) {
+      nighterm_release(context, context->terminals[i].cells);
+      nighterm_release(context, context->terminals[i].history.data);
+    }
+    context->terminals[i] = (struct nighterm_terminal){ 0 };
+  }
+  context->damage = NULL;
+  context->glyph_pixels = NULL;
+  context->cells = NULL;
+  context->dirty = NULL;
+  context->flip_damage = NULL;
+  context->malloc = NULL;
+  context->free = NULL;
+#endif
+  context->backbuffer = NULL;
+  context->backbuffer_size = 0;
+  context->backbuffer_owned = 0;
+  context->history = (struct nighterm_history){ 0 };
+  context->malloc = NULL;
+  context->free = NULL;
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Changes the font.
+ *
+ * @param context
+ *        Pointer to Nighterm context
+ *
+ * @param font
+ *        Pointer to a buffer containing a new font
+ *
+ * @param font_size
+ *        Size of the font buffer in bytes
+ *
+ * Only the active terminal changes font, unless the new font has a different
+ * glyph size: then all terminals change font, and their grids are resized.
+ *
+ * @return NIGHTERM_SUCCESS if the font has been changed sucessfully;
+ *         NIGHTERM_FONT_INVALID if the font is not a valid PSF2 font;
+ *         NIGHTERM_NO_MORE_MEMORY if the glyph cache could not be resized,
+ *         or a background terminal could not be resized and was closed.
+ */
+int
+nighterm_set_font(struct nighterm_ctx *context, void *font, uint64_t font_size)
+{
+  if (font == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  uint32_t old_cols = context->cols;
+  uint32_t old_rows = context->rows;
+
+  nighterm_leave_view(context);
+
+  int status = nighterm_load_font(context, font, font_size);
+  if (status != NIGHTERM_SUCCESS) {
+    return status;
+  }
+
+  if (context->cols != old_cols || context->rows != old_rows) {
+    status = nighterm_resize_terminals(context, old_cols, old_rows);
+  }
+
+  nighterm_update(context);
+
+  return status;
+}
+
+/**
+ * @brief Creates a virtual terminal.
+ *
+ * A terminal costs its character grid, 12 bytes per cell, plus a small
+ * record in the context; only the active terminal is drawn.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param optional name
+ *                 Name of the terminal, truncated to
+ *                 NIGHTERM_TERMINAL_NAME_SIZE - 1 characters
+ *
+ * @param optional font
+ *                 PSF2 font of the terminal; must have the same glyph size
+ *                 as the current font. If NULL, the current font is used.
+ *
+ * @param          font_size
+ *                 Size of the font buffer in bytes; ignored without a font
+ *
+ * @param          should_switch
+ *                 Non-zero to switch to the new terminal
+ *
+ * @return         Identifier of the new terminal (0 or more) if it was
+ *                 created; NIGHTERM_FONT_INVALID if the font is invalid or
+ *                 of another size; NIGHTERM_NO_MORE_MEMORY if there are
+ *                 already NIGHTERM_MAX_TERMINALS terminals or the grid could
+ *                 not be allocated, or does not fit terminal_storage.
+ */
+int
+nighterm_create_terminal(struct nighterm_ctx *context,
+                         const char *name,
+                         void *font,
+                         uint64_t font_size,
+                         uint8_t should_switch)
+{
+  if (context == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  if (font == NULL) {
+    font = context->font;
+    font_size = context->font_size;
+  } else {
+    struct nighterm_psf2_header header;
+    void *data;
+    int status = nighterm_parse_font(font, font_size, &header, &data);
+    if (status != NIGHTERM_SUCCESS) {
+      return status;
+    }
+    if (header.width != context->cell_width ||
+        header.height != context->cell_height) {
+      return NIGHTERM_FONT_INVALID;
+    }
+  }
+
+  uint32_t id = 0;
+  while (id < NIGHTERM_MAX_TERMINALS && context->terminals[id].used) {
+    id++;
+  }
+  if (id == NIGHTERM_MAX_TERMINALS) {
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+
+  uint64_t count = (uint64_t)context->rows * context->cols;
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  struct nighterm_cell *cells = (struct nighterm_cell *)context->malloc(
+    count * sizeof(struct nighterm_cell));
+  if (cells == NULL) {
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+#else
+  /* The console keeps the embedded grid, so slots start at terminal 1. */
+  uint64_t slot = NIGHTERM_TERMINAL_SIZE(context->fb_width, context->fb_height);
+  if (context->hooks.terminal_storage == NULL ||
+      context->hooks.terminal_storage_size / slot < id) {
+    return NIGHTERM_NO_MORE_MEMORY;
+  }
+  struct nighterm_cell *cells =
+    (struct nighterm_cell *)((uint8_t *)context->hooks.terminal_storage +
+                             (id - 1) * slot);
+#endif
+
+  struct nighterm_cell blank = { ' ', context->default_fg, context->default_bg };
+  for (uint64_t i = 0; i < count; i++) {
+    cells[i] = blank;
+  }
+
+  struct nighterm_terminal *terminal = &context->terminals[id];
+  *terminal = (struct nighterm_terminal){ 0 };
+  nighterm_copy_name(terminal->name, name);
+  terminal->used = 1;
+  terminal->font = font;
+  terminal->font_size = font_size;
+  terminal->cells = cells;
+  terminal->scroll_bottom = context->rows;
+  terminal->cursor_style = context->cursor_style;
+  terminal->cursor_flags =
+    NIGHTERM_CURSOR_VISIBLE | (context->cursor_flags & NIGHTERM_CURSOR_BLINK);
+  terminal->vt_state = NIGHTERM_VT_GROUND;
+  terminal->default_fg = context->default_fg;
+  terminal->default_bg = context->default_bg;
+  terminal->sgr_fg = NIGHTERM_SGR_DEFAULT;
+  terminal->sgr_bg = NIGHTERM_SGR_DEFAULT;
+  terminal->fg_color = context->default_fg;
+  terminal->bg_color = context->default_bg;
+
+  if (should_switch) {
+    nighterm_switch_terminal(context, (int)id);
+  }
+
+  return (int)id;
+}
+
+/**
+ * @brief Makes a virtual terminal the active one, and repaints the screen
+ *        from its character grid.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          id
+ *                 Identifier returned by nighterm_create_terminal(), or 0
+ *                 for the terminal created by nighterm_initialize()
+ *
+ * @return         NIGHTERM_SUCCESS if the terminal is active;
+ *                 NIGHTERM_INVALID_PARAMETER if there is no such terminal.
+ */
+int
+nighterm_switch_terminal(struct nighterm_ctx *context, int id)
+{
+  if (context == NULL || id < 0 || id >= NIGHTERM_MAX_TERMINALS ||
+      !context->terminals[id].used) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  if ((uint32_t)id == context->active_terminal) {
+    return NIGHTERM_SUCCESS;
+  }
+
+  void *font = context->font;
+
+  nighterm_leave_view(context);
+  nighterm_exchange_terminal(context,
+                             &context->terminals[context->active_terminal]);
+  nighterm_exchange_terminal(context, &context->terminals[id]);
+  context->active_terminal = (uint32_t)id;
+
+  if (context->font != font) {
+    /* Validated by nighterm_create_terminal(). */
+    nighterm_parse_font(context->font,
+                        context->font_size,
+                        &context->font_header,
+                        &context->font_data);
+    nighterm_build_unicode_index(context);
+    nighterm_invalidate_glyphs(context);
+  }
+
+  /* Every cell is redrawn over the old terminal's. */
+  for (uint32_t row = 0; row < context->rows; row++) {
+    nighterm_mark_dirty(context, row, 0, context->cols);
+  }
+
+  nighterm_update(context);
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Parses a buffer of characters into a virtual terminal. Writes to
+ *        a background terminal only update its character grid.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          id
+ *                 Identifier of the terminal
+ *
+ * @param          buf
+ *                 Characters to be written
+ *
+ * @param          len
+ *                 Amount of characters in buf
+ *
+ * @return         NIGHTERM_SUCCESS if the characters were written;
+ *                 NIGHTERM_INVALID_PARAMETER if there is no such terminal.
+ */
+int
+nighterm_write_terminal(struct nighterm_ctx *context,
+                        int id,
+                        const char *buf,
+                        size_t len)
+{
+  if (context == NULL || id < 0 || id >= NIGHTERM_MAX_TERMINALS ||
+      !context->terminals[id].used) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  if ((uint32_t)id == context->active_terminal) {
+    nighterm_write_buffer(context, buf, len);
+    return NIGHTERM_SUCCESS;
+  }
+
+  nighterm_exchange_terminal(context, &context->terminals[id]);
+  context->background = 1;
+  nighterm_parse(context, buf, len);
+  context->background = 0;
+  nighterm_exchange_terminal(context, &context->terminals[id]);
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Scrolls the view of the active terminal back into its scrollback,
+ *        repainting the screen. Only the console, the terminal created by
+ *        nighterm_initialize(), keeps a scrollback.
+ *
+ * Any output to the terminal returns the view to the live screen.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          lines
+ *                 Lines to scroll back from the live screen; 0 returns to
+ *                 it, and values past the oldest line stop there
+ *
+ * @return         NIGHTERM_SUCCESS if the view has been moved;
+ *                 NIGHTERM_INVALID_PARAMETER if the context is NULL.
+ */
+int
+nighterm_set_view(struct nighterm_ctx *context, uint32_t lines)
+{
+  if (context == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  struct nighterm_history *history = &context->history;
+  if (lines > history->lines) {
+    lines = history->lines;
+  }
+  if (lines == history->view) {
+    return NIGHTERM_SUCCESS;
+  }
+
+  if (lines == 0) {
+    nighterm_leave_view(context);
+  } else {
+    history->view_top = nighterm_history_seek(history, lines);
+    history->view = lines;
+    nighterm_paint_view(context);
+  }
+
+  nighterm_update(context);
+
+  return NIGHTERM_SUCCESS;
+}
+
 /**
- * @private
- * @brief Copies n chunks of memory to destination.
- * 
- * @param          dest
- *                 Pointer to destination memory
- * 
- * @param          src
- *                 Pointer to source memory
- * 
- * @param          n
- *                 Amount of bytes to copy
+ * @brief Moves the view of the active terminal relative to its current
+ *        position, see nighterm_set_view(). Paging moves by the amount of
+ *        rows.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          lines
+ *                 Lines to scroll back (positive) or forward (negative)
+ *
+ * @return         NIGHTERM_SUCCESS if the view has been moved;
+ *                 NIGHTERM_INVALID_PARAMETER if the context is NULL.
+ */
+int
+nighterm_scroll_view(struct nighterm_ctx *context, int32_t lines)
+{
+  if (context == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  int64_t view = (int64_t)context->history.view + lines;
+  if (view < 0) {
+    view = 0;
+  }
+  if (view > context->history.lines) {
+    view = context->history.lines;
+  }
+
+  return nighterm_set_view(context, (uint32_t)view);
+}
+
+/**
+ * @brief Gets the position of the view of the active terminal.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param optional view
+ *                 Lines scrolled back from the live screen
+ *
+ * @param optional lines
+ *                 Lines kept in the scrollback
  */
 void
-nighterm_memcpy(void *dest, void *src, size_t n)
+nighterm_get_view(struct nighterm_ctx *context,
+                  uint32_t *view,
+                  uint32_t *lines)
+{
+  if (view != NULL) {
+    *view = context->history.view;
+  }
+  if (lines != NULL) {
+    *lines = context->history.lines;
+  }
+}
+
+/**
+ * @brief Sets the framebuffer's pixel layout, as reported by the
+ *        bootloader or display driver, and redraws the screen in it.
+ *
+ * nighterm_initialize() assumes x8r8g8b8 for 24 and 32bpp, r5g6b5 for
+ * 16bpp, x1r5g5b5 for 15bpp and r3g3b2 for 8bpp.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          red_size
+ *                 Size of the red component in bits
+ *
+ * @param          red_shift
+ *                 Position of the red component's lowest bit
+ *
+ * @param          green_size
+ *                 Size of the green component in bits
+ *
+ * @param          green_shift
+ *                 Position of the green component's lowest bit
+ *
+ * @param          blue_size
+ *                 Size of the blue component in bits
+ *
+ * @param          blue_shift
+ *                 Position of the blue component's lowest bit
+ *
+ * @return         NIGHTERM_SUCCESS if the layout has been changed;
+ *                 NIGHTERM_INVALID_PARAMETER if it does not fit the
+ *                 framebuffer's bpp.
+ */
+int
+nighterm_set_pixel_format(struct nighterm_ctx *context,
+                          uint8_t red_size,
+                          uint8_t red_shift,
+                          uint8_t green_size,
+                          uint8_t green_shift,
+                          uint8_t blue_size,
+                          uint8_t blue_shift)
 {
-  char *psrc = (char *)src;
-  char *pdest = (char *)dest;
+  uint8_t old[6] = { context->red_size,   context->red_shift,
+                     context->green_size, context->green_shift,
+                     context->blue_size,  context->blue_shift };
+
+  int status = nighterm_setup_format(context,
+                                     red_size,
+                                     red_shift,
+                                     green_size,
+                                     green_shift,
+                                     blue_size,
+                                     blue_shift);
+  if (status != NIGHTERM_SUCCESS) {
+    return status;
+  }
+
+  nighterm_leave_view(context);
+
+  /* Repack every stored color from the old layout into the new one. */
+#define NIGHTERM_REPACK(value)                                                \
+  nighterm_pack_color(context,                                                \
+                      nighterm_unpack_component((value), old[0], old[1]),     \
+                      nighterm_unpack_component((value), old[2], old[3]),     \
+                      nighterm_unpack_component((value), old[4], old[5]))
+
+  context->default_fg = NIGHTERM_REPACK(context->default_fg);
+  context->default_bg = NIGHTERM_REPACK(context->default_bg);
+  for (uint32_t i = 0; i < context->rows * context->cols; i++) {
+    context->cells[i].fg = NIGHTERM_REPACK(context->cells[i].fg);
+    context->cells[i].bg = NIGHTERM_REPACK(context->cells[i].bg);
+  }
+
+  for (uint32_t t = 0; t < NIGHTERM_MAX_TERMINALS; t++) {
+    struct nighterm_terminal *terminal = &context->terminals[t];
+    if (!terminal->used || t == context->active_terminal) {
+      continue;
+    }
+    terminal->default_fg = NIGHTERM_REPACK(terminal->default_fg);
+    terminal->default_bg = NIGHTERM_REPACK(terminal->default_bg);
+    terminal->fg_color = NIGHTERM_REPACK(terminal->fg_color);
+    terminal->bg_color = NIGHTERM_REPACK(terminal->bg_color);
+    for (uint32_t i = 0; i < context->rows * context->cols; i++) {
+      terminal->cells[i].fg = NIGHTERM_REPACK(terminal->cells[i].fg);
+      terminal->cells[i].bg = NIGHTERM_REPACK(terminal->cells[i].bg);
+    }
+  }
+
+  for (uint32_t t = 0; t <= NIGHTERM_MAX_TERMINALS; t++) {
+    struct nighterm_history *history = &context->history;
+    if (t < NIGHTERM_MAX_TERMINALS) {
+      if (t == context->active_terminal) {
+        continue;
+      }
+      history = &context->terminals[t].history;
+    }
+    if (history->data == NULL) {
+      continue;
+    }
 
-  for (size_t i = 0; i < n; i++) {
-    pdest[i] = psrc[i];
+    uint32_t pos = history->tail;
+    for (uint32_t line = 0; line < history->lines; line++) {
+      uint32_t runs = nighterm_history_get(history, pos + 5, 2);
+      uint32_t run = pos + NIGHTERM_HISTORY_HEADER;
+      for (uint32_t i = 0; i < runs; i++, run += NIGHTERM_HISTORY_RUN) {
+        uint32_t fg = nighterm_history_get(history, run + 2, 4);
+        uint32_t bg = nighterm_history_get(history, run + 6, 4);
+        nighterm_history_put(history, run + 2, NIGHTERM_REPACK(fg), 4);
+        nighterm_history_put(history, run + 6, NIGHTERM_REPACK(bg), 4);
+      }
+      pos += nighterm_history_get(history, pos, 2);
+    }
   }
+
+#undef NIGHTERM_REPACK
+
+  nighterm_build_palette(context);
+  nighterm_update_pen(context);
+
+  nighterm_invalidate_glyphs(context);
+  nighterm_invalidate_screen(context);
+  nighterm_update(context);
+
+  return NIGHTERM_SUCCESS;
 }
 
 /**
- * @private
- * @brief Draws a pixel to backbuffer of the current terminal.
+ * @brief Sets foreground (text) color for the currently selected terminal.
+ *        It becomes the default color of SGR sequences as well.
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          x
- *                 X position
+ * @param          r
+ *                 Red color value (0-255)
  *
- * @param          y
- *                 Y position
+ * @param          g
+ *                 Green color value (0-255)
+ *
+ * @param          b
+ *                 Blue color value (0-255)
+ */
+void
+nighterm_set_fg_color(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
+{
+  context->default_fg = nighterm_pack_color(context, r, g, b);
+  context->sgr_fg = NIGHTERM_SGR_DEFAULT;
+  nighterm_update_pen(context);
+}
+
+/**
+ * @brief Sets background color for the currently selected terminal.
+ *        It becomes the default color of SGR sequences as well.
+ *
+ * @param          context
+ *                 Nighterm context
  *
  * @param          r
  *                 Red color value (0-255)
@@ -52,200 +5692,293 @@ nighterm_memcpy(void *dest, void *src, size_t n)
  *                 Blue color value (0-255)
  */
 void
-nighterm_putpixel(struct nighterm_ctx *context,
-                         uint64_t x,
-                         uint64_t y,
-                         uint8_t r,
-                         uint8_t g,
-                         uint8_t b)
+nighterm_set_bg_color(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
 {
-  context->backbuffer[x * (context->fb_bpp >> 3) + y * context->fb_pitch] = (0xFF << 24) | (r << 16) | (g << 8) | b;
+  context->default_bg = nighterm_pack_color(context, r, g, b);
+  context->sgr_bg = NIGHTERM_SGR_DEFAULT;
+  nighterm_update_pen(context);
 }
 
 /**
- * @private
- * @brief Copies backbuffer to the framebuffer
- * 
+ * @brief Sets the cursor to an absolute position.
+ *
  * @param          context
  *                 Nighterm context
+ *
+ * @param          x
+ *                 Absolute x position, clamped to the last column
+ *
+ * @param          y
+ *                 Absolute y position, clamped to the last row
  */
 void
-nighterm_flush_backbuffer(struct nighterm_ctx *context)
+nighterm_set_cursor_position(struct nighterm_ctx *context, uint32_t x, uint32_t y)
 {
-  nighterm_memcpy(context->fb_addr, context->backbuffer, context->fb_height * context->fb_pitch);
+  context->cur_x = x;
+  context->cur_y = y;
+  nighterm_vt_clamp_cursor(context);
+  nighterm_update(context);
 }
 
 /**
- * @brief Initializes Nighterm terminals and configuration.
+ * @brief Sets the cursor to a relative position from its current position.
  *
- * @param          config
- *                 Pointer to a new context structure.
+ * @param          context
+ *                 Nighterm context
  *
- * @param optional font
- *                 Pointer to a font buffer. If NULL, default font is used.
+ * @param          x
+ *                 Relative x position
  *
- * @param          framebuffer_addr
- *                 Framebuffer address
+ * @param          y
+ *                 Relative y position
  *
- * @param          framebuffer_width
- *                 Framebuffer width in pixels
+ * The cursor stops at the edges of the screen.
+ */
+void
+nighterm_move_cursor(struct nighterm_ctx *context, int32_t x, int32_t y)
+{
+  int64_t new_x = (int64_t)context->cur_x + x;
+  int64_t new_y = (int64_t)context->cur_y + y;
+
+  context->cur_x = new_x < 0 ? 0
+                  : new_x < context->cols ? (uint32_t)new_x
+                                          : context->cols;
+  context->cur_y = new_y < 0 ? 0
+                  : new_y < context->rows ? (uint32_t)new_y
+                                          : context->rows;
+  nighterm_vt_clamp_cursor(context);
+  nighterm_update(context);
+}
+
+/**
+ * @brief Gets the current cursor's coordinates
  *
- * @param          framebuffer_height
- *                 Framebuffer height in pixelss
+ * @param          context
+ *                 Nighterm context
  *
- * @param          framebuffer_bpp
- *                 Framebuffer's Bits per Pixel
+ * @param ptr      x
+ *                 X position
  *
- * @param optional custom_malloc
- *                 Pointer to a malloc() function
- *                 provided by the host OS
+ * @param ptr      y
+ *                 Y position
+ */
+void
+nighterm_get_cursor_position(struct nighterm_ctx *context, uint32_t* x, uint32_t* y)
+{
+  *x = context->cur_x;
+  *y = context->cur_y;
+}
+
+/**
+ * @brief Sets the shape of the cursor of the currently selected terminal.
  *
- * @return         NIGHTERM_SUCCESS if the initialization was successful;
- *                 error code otherwise. All error codes are defined in
- *                 nighterm.h.
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          style
+ *                 Shape of the cursor
+ *
+ * @param          blink
+ *                 Non-zero to blink on nighterm_blink_cursor()
+ *
+ * @return         NIGHTERM_SUCCESS if the style was set;
+ *                 NIGHTERM_INVALID_PARAMETER for an unknown style.
  */
 int
-nighterm_initialize(struct nighterm_ctx *config,
-                    void *font,
-                    void *framebuffer_addr,
-                    uint64_t framebuffer_width,
-                    uint64_t framebuffer_height,
-                    uint16_t framebuffer_bpp,
-                    nighterm_malloc custom_malloc,
-                    nighterm_free custom_free)
+nighterm_set_cursor_style(struct nighterm_ctx *context,
+                          enum nighterm_cursor_style style,
+                          uint8_t blink)
 {
-  if (font == NULL) {
-    /* No font supplied. */
-    font = &nighterm_default_font;
+  if (context == NULL || style > NIGHTERM_CURSOR_BAR) {
+    return NIGHTERM_INVALID_PARAMETER;
   }
 
-  if (framebuffer_addr == NULL) {
-    /* No framebuffer specified, or invalid address. */
-    return NIGHTERM_INVALID_PARAMETER;
+  nighterm_hide_cursor(context);
+  context->cursor_style = (uint8_t)style;
+  if (blink) {
+    context->cursor_flags |= NIGHTERM_CURSOR_BLINK;
+  } else {
+    context->cursor_flags &= (uint8_t)~NIGHTERM_CURSOR_BLINK;
+    context->cursor_blink_off = 0;
   }
 
-  if (framebuffer_width < 1 || framebuffer_height < 1) {
-    /* Invalid framebuffer dimensions. */
-    return NIGHTERM_INVALID_PARAMETER;
+  nighterm_update(context);
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Shows or hides the cursor of the currently selected terminal, as
+ *        CSI ? 25 h and l do.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          visible
+ *                 Non-zero to show the cursor
+ */
+void
+nighterm_set_cursor_visible(struct nighterm_ctx *context, uint8_t visible)
+{
+  if (visible) {
+    context->cursor_flags |= NIGHTERM_CURSOR_VISIBLE;
+  } else {
+    context->cursor_flags &= (uint8_t)~NIGHTERM_CURSOR_VISIBLE;
   }
 
-  if (framebuffer_bpp < 1) {
-    /* Invalid framebuffer bpp. */
-    return NIGHTERM_INVALID_PARAMETER;
+  nighterm_update(context);
+}
+
+/**
+ * @brief Advances the cursor blink by half a period: a blinking cursor is
+ *        taken off the screen or put back. Meant to be called from a host
+ *        timer, typically every 500 ms.
+ *
+ * Only the pixels of the cell under the cursor are drawn and flushed. If
+ * other changes are waiting for nighterm_present(), nothing is drawn and
+ * the next frame shows the new blink phase.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_blink_cursor(struct nighterm_ctx *context)
+{
+  if (!(context->cursor_flags & NIGHTERM_CURSOR_BLINK)) {
+    return;
   }
 
-  config->fb_addr = framebuffer_addr;
-  config->fb_width = framebuffer_width;
-  config->fb_height = framebuffer_height;
-  config->fb_pitch = framebuffer_width * ((framebuffer_bpp | 7) >> 3);
-  config->fb_bpp = framebuffer_bpp;
+  context->cursor_blink_off ^= 1;
 
-#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
-  if (custom_malloc == NULL || custom_free == NULL) {
-    return NIGHTERM_INVALID_PARAMETERS;
+  if (context->dirty_first <= context->dirty_last ||
+      context->damage_first <= context->damage_last) {
+    return;
   }
-  config->malloc = custom_malloc;
-  config->free = custom_free;
-#else
-  (void)custom_malloc;
-  (void)custom_free;
-  config->malloc = NULL;
-  config->free = NULL;
-#endif
 
-  int status = NIGHTERM_SUCCESS;
-    /*nighterm_parse_font(font,
-                                    &config->font_header,
-                                    &config->font_data); */
-  if (status != NIGHTERM_SUCCESS) {
-    return status;
+  nighterm_render(context);
+  nighterm_flush_backbuffer(context);
+}
+
+/**
+ * @brief Selects when writes reach the framebuffer.
+ *
+ * Switching to NIGHTERM_PRESENT_IMMEDIATE presents everything pending
+ * right away, so panic handlers can call it before printing.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          mode
+ *                 Presentation mode
+ *
+ * @param          max_fps
+ *                 Maximum rate of nighterm_present() frames per second,
+ *                 or 0 for no limit. Needs the clock hooks.
+ *
+ * @return         NIGHTERM_SUCCESS if the mode was changed;
+ *                 NIGHTERM_INVALID_PARAMETER if the mode is unknown.
+ */
+int
+nighterm_set_present_mode(struct nighterm_ctx *context,
+                          enum nighterm_present_mode mode,
+                          uint32_t max_fps)
+{
+  if (mode != NIGHTERM_PRESENT_IMMEDIATE &&
+      mode != NIGHTERM_PRESENT_DEFERRED) {
+    return NIGHTERM_INVALID_PARAMETER;
   }
 
-#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
-  config->backbuffer = (uint8_t *)malloc((config->fb_height * config->fb_width) * sizeof(uint32_t));
-#else
-  if (framebuffer_width > NIGHTERM_MAX_FB_WIDTH ||
-      framebuffer_height > NIGHTERM_MAX_FB_HEIGHT) {
-    config->fb_width = NIGHTERM_MAX_FB_WIDTH;
-    config->fb_height = NIGHTERM_MAX_FB_HEIGHT;
+  context->present_mode = (uint8_t)mode;
+  context->frame_interval = 0;
+  if (max_fps != 0 && context->hooks.clock != NULL &&
+      context->hooks.clock_hz != 0) {
+    context->frame_interval = context->hooks.clock_hz / max_fps;
+    context->last_present =
+      context->hooks.clock(context->hooks.user) - context->frame_interval;
   }
-#endif
 
-  // config->rows = (config->fb_height / config->font_header.height);
-  // config->cols = (config->fb_width / config->font_header.width);
-  config->rows = (config->fb_height / 16);
-  config->cols = (config->fb_width / 8);
-  config->cur_x = 0;
-  config->cur_y = 0;
-  config->fg_color = 0xFFFFFFFF;
-  config->bg_color = 0xFF000000;
+  nighterm_update(context);
 
   return NIGHTERM_SUCCESS;
 }
 
 /**
- * @brief Frees all allocated memory and deinitializes Nighterm.
- *
+ * @brief Draws and flushes everything written since the last frame, as a
+ *        single frame. Meant to be called from a host timer or the idle
+ *        loop in NIGHTERM_PRESENT_DEFERRED mode.
  *
  * @param          context
  *                 Nighterm context
+ *
+ * @return         Non-zero if a frame was presented; zero if the last one
+ *                 was too recent for the maximum frame rate.
  */
 int
-nighterm_shutdown(struct nighterm_ctx *context)
+nighterm_present(struct nighterm_ctx *context)
 {
-  if (context == NULL) {
-    return NIGHTERM_INVALID_PARAMETER;
+  if (context->frame_interval != 0) {
+    uint64_t now = context->hooks.clock(context->hooks.user);
+    if (now - context->last_present < context->frame_interval) {
+      return 0;
+    }
+    context->last_present = now;
   }
 
-  context->fb_addr = 0;
-  context->fb_width = 0;
-  context->fb_height = 0;
-  context->fb_pitch = 0;
-  context->fb_bpp = 0;
-  context->rows = 0;
-  context->cols = 0;
-  context->cur_x = 0;
-  context->cur_y = 0;
-  context->fg_color = 0;
-  context->bg_color = 0;
-  context->font_data = NULL;
-#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
-  context->free(context->backbuffer);
-  context->malloc = NULL;
-  context->free = NULL;
-#endif
-  context->malloc = NULL;
-  context->free = NULL;
+  nighterm_render(context);
+  nighterm_flush_backbuffer(context);
 
-  return NIGHTERM_SUCCESS;
+  return 1;
 }
 
 /**
- * @brief Changes the font.
+ * @brief Copies the performance counters.
  *
- * @param context
- *        Pointer to Nighterm context
+ * @param          context
+ *                 Nighterm context
  *
- * @param font
- *        Pointer to a buffer containing a new font
+ * @param          stats
+ *                 Receives the counters
  *
- * @return NIGHTERM_SUCCESS if the font has been changed sucessfully;
- *         NIGHTERM_INVALID_FONT otherwise.
+ * @return         NIGHTERM_SUCCESS if the counters were copied;
+ *                 NIGHTERM_ERROR if Nighterm was built without
+ *                 NIGHTERM_ENABLE_STATS, in which case stats is zeroed.
  */
 int
-nighterm_set_font(struct nighterm_ctx *context, void *font)
+nighterm_get_stats(struct nighterm_ctx *context, struct nighterm_stats *stats)
 {
-  (void)context;
-  if (font == NULL) {
-    return -1;
+  if (context == NULL || stats == NULL) {
+    return NIGHTERM_INVALID_PARAMETER;
   }
 
-  // return nighterm_parse_font(font, &context->font_header, &context->font_data);
+#ifdef NIGHTERM_ENABLE_STATS
+  *stats = context->stats;
+  stats->ring_dropped = __atomic_load_n(&context->ring_dropped, __ATOMIC_RELAXED);
+  return NIGHTERM_SUCCESS;
+#else
+  *stats = (struct nighterm_stats){ 0 };
   return NIGHTERM_ERROR;
+#endif
 }
 
 /**
- * @brief Sets foreground (text) color for the currently selected terminal.
+ * @brief Resets all performance counters to zero.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_reset_stats(struct nighterm_ctx *context)
+{
+#ifdef NIGHTERM_ENABLE_STATS
+  context->stats = (struct nighterm_stats){ 0 };
+  __atomic_store_n(&context->ring_dropped, 0, __ATOMIC_RELAXED);
+#else
+  (void)context;
+#endif
+}
+
+/**
+ * @brief Clears the screen with a single color
  *
  * @param          context
  *                 Nighterm context
@@ -260,160 +5993,563 @@ nighterm_set_font(struct nighterm_ctx *context, void *font)
  *                 Blue color value (0-255)
  */
 void
-nighterm_set_fg_color(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
+nighterm_flush(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
 {
-  context->fg_color =
-    (0xFF << 24) | (r << 16) | (g << 8) | b;
+  uint32_t color = nighterm_pack_color(context, r, g, b);
+
+  nighterm_leave_view(context);
+  nighterm_fill_rect(
+    context, 0, 0, context->fb_width, context->fb_height, color);
+  context->cursor_drawn = 0;
+
+  /* The fill already drew every cell blank; keep the grid in sync without
+   * marking anything for rasterization. */
+  struct nighterm_cell blank = { ' ', context->fg_color, color };
+  for (uint32_t i = 0; i < context->rows * context->cols; i++) {
+    context->cells[i] = blank;
+  }
+  nighterm_reset_dirty(context);
+
+  nighterm_update(context);
 }
 
 /**
- * @brief Sets background color for the currently selected terminal.
+ * @private
+ * @brief Parses a single character for escape sequences and draws it to
+ *        the backbuffer, without flushing it to the framebuffer.
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          r
- *                 Red color value (0-255)
+ * @param          c
+ *                 Character to be drawn
+ */
+void
+nighterm_putc(struct nighterm_ctx *context, char c)
+{
+  nighterm_parse(context, &c, 1);
+}
+
+/**
+ * @brief Parses a single character for escape sequences and draws it
  *
- * @param          g
- *                 Green color value (0-255)
+ * @param          context
+ *                 Nighterm context
  *
- * @param          b
- *                 Blue color value (0-255)
+ * @param          c
+ *                 Character to be drawn
  */
 void
-nighterm_set_bg_color(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
+nighterm_write(struct nighterm_ctx *context, char c)
 {
-  context->bg_color =
-    (0xFF << 24) | (r << 16) | (g << 8) | b;
+  NIGHTERM_STAT_START(context);
+  nighterm_putc(context, c);
+  NIGHTERM_STAT_STOP(context, parse_time);
+
+  nighterm_update(context);
 }
 
 /**
- * @brief Sets the cursor to an absolute position.
+ * @brief Parses and draws a buffer of characters, then flushes all damaged
+ *        areas to the framebuffer at once. In NIGHTERM_PRESENT_DEFERRED
+ *        mode, drawing and flushing wait for nighterm_present().
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          x
- *                 Absolute x position
- *
- * @param          y
- *                 Absolute y position
+ * @param          buf
+ *                 Characters to be drawn
  *
- * @todo Check if the coordinates exceed the framebuffer's width/height
+ * @param          len
+ *                 Amount of characters in buf
  */
 void
-nighterm_set_cursor_position(struct nighterm_ctx *context, uint32_t x, uint32_t y)
+nighterm_write_buffer(struct nighterm_ctx *context, const char *buf, size_t len)
 {
-  context->cur_x = x;
-  context->cur_y = y;
+  NIGHTERM_STAT_START(context);
+  nighterm_parse(context, buf, len);
+  NIGHTERM_STAT_STOP(context, parse_time);
+
+  nighterm_update(context);
 }
 
 /**
- * @brief Sets the cursor to a relative position from its current position.
+ * @brief Draws UTF-8 text at a position of the currently selected
+ *        terminal, as for status lines. Escape sequences are not
+ *        interpreted, the cursor does not move, and text past the end of
+ *        the row is cut off rather than wrapped.
+ *
+ * Only cells whose contents change are drawn and flushed, so redrawing
+ * mostly unchanged text is cheap. In NIGHTERM_PRESENT_DEFERRED mode,
+ * drawing and flushing wait for nighterm_present(); while the scrollback
+ * is shown, they wait for the live screen.
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          x
- *                 Relative x position
+ * @param          col
+ *                 Column of the first character
  *
- * @param          y
- *                 Relative y position
+ * @param          row
+ *                 Row of the text
  *
- * @todo Check if the coordinates exceed the framebuffer's width/height
+ * @param          text
+ *                 UTF-8 text
+ *
+ * @param          len
+ *                 Amount of bytes in text
+ *
+ * @param optional attr
+ *                 Colors and attributes; NULL for the default colors
+ *
+ * @return         NIGHTERM_SUCCESS if the text was drawn;
+ *                 NIGHTERM_INVALID_PARAMETER if the position is off the
+ *                 screen.
  */
-void
-nighterm_move_cursor(struct nighterm_ctx *context, int32_t x, int32_t y)
+int
+nighterm_draw_text_at(struct nighterm_ctx *context,
+                      uint32_t col,
+                      uint32_t row,
+                      const char *text,
+                      size_t len,
+                      const struct nighterm_attr *attr)
 {
-  context->cur_x += x;
-  context->cur_y += y;
+  if (context == NULL || (text == NULL && len > 0) || row >= context->rows ||
+      col >= context->cols) {
+    return NIGHTERM_INVALID_PARAMETER;
+  }
+
+  uint32_t fg = context->default_fg;
+  uint32_t bg = context->default_bg;
+  if (attr != NULL) {
+    nighterm_resolve_colors(context, attr->fg, attr->bg, attr->flags, &fg, &bg);
+  }
+
+  NIGHTERM_STAT_START(context);
+  NIGHTERM_STAT_ADD(context, chars_written, len);
+
+  size_t i = 0;
+  while (i < len && col < context->cols) {
+    size_t run = nighterm_ascii_run(text + i, len - i);
+    if (run > 0) {
+      uint32_t room = context->cols - col;
+      uint32_t count = run < room ? (uint32_t)run : room;
+      nighterm_set_cells(context, col, row, text + i, count, fg, bg);
+      col += count;
+      i += count;
+      continue;
+    }
+
+    uint32_t codepoint;
+    i += nighterm_utf8_decode(text + i, len - i, &codepoint);
+    nighterm_set_cell(context, col++, row, codepoint, fg, bg);
+  }
+
+  NIGHTERM_STAT_STOP(context, parse_time);
+
+  nighterm_update(context);
+
+  return NIGHTERM_SUCCESS;
 }
 
 /**
- * @brief Gets the current cursor's coordinates
+ * @private
+ * @brief Draws a run of padding characters for nighterm_vprintf(), in
+ *        chunks from a small fill buffer.
  *
  * @param          context
  *                 Nighterm context
  *
- * @param ptr      x
- *                 X position
+ * @param          pad
+ *                 Padding character
  *
- * @param ptr      y
- *                 Y position
+ * @param          count
+ *                 Amount of padding characters
  */
 void
-nighterm_get_cursor_position(struct nighterm_ctx *context, uint32_t* x, uint32_t* y)
+nighterm_put_padding(struct nighterm_ctx *context, char pad, size_t count)
 {
-  *x = context->cur_x;
-  *y = context->cur_y;
+  char fill[32];
+
+  for (size_t i = 0; i < sizeof(fill); i++) {
+    fill[i] = pad;
+  }
+
+  while (count > 0) {
+    size_t chunk = count < sizeof(fill) ? count : sizeof(fill);
+    nighterm_parse(context, fill, chunk);
+    count -= chunk;
+  }
 }
 
 /**
- * @brief Clears the screen with a single color
+ * @private
+ * @brief Formats an integer for nighterm_vprintf().
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          r
- *                 Red color value (0-255)
+ * @param          value
+ *                 Absolute value of the integer
  *
- * @param          g
- *                 Green color value (0-255)
+ * @param          negative
+ *                 Non-zero if a minus sign should be printed
  *
- * @param          b
- *                 Blue color value (0-255)
+ * @param          base
+ *                 Numeric base (8, 10 or 16)
+ *
+ * @param          upper
+ *                 Non-zero for uppercase hexadecimal digits
+ *
+ * @param          width
+ *                 Minimum field width
+ *
+ * @param          pad
+ *                 Padding character (' ' or '0')
+ *
+ * @param          left
+ *                 Non-zero to left-justify within the field
  */
 void
-nighterm_flush(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b)
+nighterm_put_number(struct nighterm_ctx *context,
+                    uint64_t value,
+                    int negative,
+                    unsigned int base,
+                    int upper,
+                    unsigned int width,
+                    char pad,
+                    int left)
+{
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char buf[24];
+  unsigned int start = sizeof(buf);
+
+  /* Digits are formatted backwards from the end, then the sign. */
+  do {
+    buf[--start] = digits[value % base];
+    value /= base;
+  } while (value != 0);
+
+  unsigned int total = (unsigned int)sizeof(buf) - start + (negative ? 1 : 0);
+  unsigned int padding = width > total ? width - total : 0;
+
+  if (negative && pad == '0') {
+    nighterm_parse(context, "-", 1);
+  } else if (negative) {
+    buf[--start] = '-';
+  }
+  if (!left) {
+    nighterm_put_padding(context, pad, padding);
+  }
+  nighterm_parse(context, buf + start, sizeof(buf) - start);
+  if (left) {
+    nighterm_put_padding(context, ' ', padding);
+  }
+}
+
+/**
+ * @brief Formats a string like vprintf() and draws it, then flushes all
+ *        damaged areas to the framebuffer at once.
+ *
+ * Supports the %c, %s, %d, %i, %u, %o, %x, %X, %p and %% conversions with
+ * the '-' and '0' flags, a field width and the l, ll, z and h length
+ * modifiers.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          fmt
+ *                 Format string
+ *
+ * @param          args
+ *                 Format arguments
+ */
+void
+nighterm_vprintf(struct nighterm_ctx *context, const char *fmt, va_list args)
 {
-  for (uint64_t y = 0; y < context->fb_height; y++) {
-    for (uint64_t x = 0; x < context->fb_width; x++) {
-      nighterm_putpixel(context, x, y, r, g, b);
+  NIGHTERM_STAT_START(context);
+
+  for (; *fmt != 0; fmt++) {
+    if (*fmt != '%') {
+      const char *run = fmt;
+      while (fmt[1] != 0 && fmt[1] != '%') {
+        fmt++;
+      }
+      nighterm_parse(context, run, (size_t)(fmt - run) + 1);
+      continue;
+    }
+
+    fmt++;
+
+    int left = 0;
+    char pad = ' ';
+    for (;; fmt++) {
+      if (*fmt == '-') {
+        left = 1;
+      } else if (*fmt == '0') {
+        pad = '0';
+      } else {
+        break;
+      }
+    }
+    if (left) {
+      pad = ' ';
+    }
+
+    unsigned int width = 0;
+    while (*fmt >= '0' && *fmt <= '9') {
+      width = width * 10 + (unsigned int)(*fmt++ - '0');
+    }
+
+    int longs = 0;
+    for (;; fmt++) {
+      if (*fmt == 'l' || *fmt == 'z') {
+        longs++;
+      } else if (*fmt != 'h') {
+        break;
+      }
+    }
+
+    uint64_t value;
+    int64_t svalue;
+
+    switch (*fmt) {
+      case 'c':
+        nighterm_putc(context, (char)va_arg(args, int));
+        break;
+      case 's': {
+        const char *str = va_arg(args, const char *);
+        if (str == NULL) {
+          str = "(null)";
+        }
+        size_t len = 0;
+        while (str[len] != 0) {
+          len++;
+        }
+        size_t padding = width > len ? width - len : 0;
+        if (!left) {
+          nighterm_put_padding(context, ' ', padding);
+        }
+        nighterm_parse(context, str, len);
+        if (left) {
+          nighterm_put_padding(context, ' ', padding);
+        }
+        break;
+      }
+      case 'd':
+      case 'i':
+        if (longs >= 2) {
+          svalue = va_arg(args, long long);
+        } else if (longs == 1) {
+          svalue = va_arg(args, long);
+        } else {
+          svalue = va_arg(args, int);
+        }
+        value = svalue < 0 ? (uint64_t)0 - (uint64_t)svalue : (uint64_t)svalue;
+        nighterm_put_number(
+          context, value, svalue < 0, 10, 0, width, pad, left);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        if (longs >= 2) {
+          value = va_arg(args, unsigned long long);
+        } else if (longs == 1) {
+          value = va_arg(args, unsigned long);
+        } else {
+          value = va_arg(args, unsigned int);
+        }
+        nighterm_put_number(context,
+                            value,
+                            0,
+                            *fmt == 'u' ? 10 : (*fmt == 'o' ? 8 : 16),
+                            *fmt == 'X',
+                            width,
+                            pad,
+                            left);
+        break;
+      case 'p':
+        nighterm_parse(context, "0x", 2);
+        nighterm_put_number(context,
+                            (uint64_t)(uintptr_t)va_arg(args, void *),
+                            0,
+                            16,
+                            0,
+                            width,
+                            pad,
+                            left);
+        break;
+      case '%':
+        nighterm_putc(context, '%');
+        break;
+      case 0:
+        /* Trailing '%'. */
+        fmt--;
+        break;
+      default: {
+        const char unknown[2] = { '%', *fmt };
+        nighterm_parse(context, unknown, 2);
+        break;
+      }
     }
   }
 
-  nighterm_flush_backbuffer(context);
+  NIGHTERM_STAT_STOP(context, parse_time);
+
+  nighterm_update(context);
 }
 
 /**
- * @brief Parses a single character for escape sequences and draws it
+ * @brief Formats a string like printf() and draws it, then flushes all
+ *        damaged areas to the framebuffer at once.
  *
  * @param          context
  *                 Nighterm context
  *
- * @param          c
- *                 Character to be drawn
+ * @param          fmt
+ *                 Format string, see nighterm_vprintf()
  */
 void
-nighterm_write(struct nighterm_ctx *context, char c)
+nighterm_printf(struct nighterm_ctx *context, const char *fmt, ...)
 {
-  switch (c) {
-    case '\n':
-      context->cur_x = 0;
-      context->cur_y++;
-      break;
-    case '\t':
-      context->cur_x += NIGHTERM_INDENT_WIDTH;
-      break;
-    case '\b':
-      // this should be handled better
-      // for now, try not to use \b.
-      context->cur_x -= 1;
-      break;
-    case 0:
-      break; // ignore termination
-    default:
-      // Why does this not work???
-      if (context->cur_x >=
-          context->cols) {
-        context->cur_x = 0;
-        context->cur_y++;
+  va_list args;
+
+  va_start(args, fmt);
+  nighterm_vprintf(context, fmt, args);
+  va_end(args);
+}
+
+/*
+ * Write ring.
+ *
+ * Records are 4-byte aligned: a header holding the payload length, then
+ * the payload. A record never wraps around the end of the ring; the space
+ * left at the end is filled with a padding record instead.
+ */
+#define NIGHTERM_RING_COMMITTED 0x80000000u
+#define NIGHTERM_RING_PADDING 0x40000000u
+#define NIGHTERM_RING_LENGTH 0x3FFFFFFFu
+
+/**
+ * @private
+ * @brief Size of a record with a payload of len bytes, header included.
+ */
+#define NIGHTERM_RING_RECORD(len) ((4 + (uint32_t)(len) + 3) & ~3u)
+
+/**
+ * @brief Queues characters for nighterm_drain(). Safe to call from any CPU
+ *        and from interrupt context: it takes no locks, and never touches
+ *        the framebuffer or the rest of the context.
+ *
+ * Each call of up to NIGHTERM_RING_SIZE / 4 bytes is kept together; longer
+ * buffers are queued in pieces that other writers may interleave with.
+ *
+ * @param          context
+ *                 Nighterm context
+ *
+ * @param          buf
+ *                 Characters to be queued
+ *
+ * @param          len
+ *                 Amount of characters in buf
+ *
+ * @return         NIGHTERM_SUCCESS if everything was queued;
+ *                 NIGHTERM_NO_MORE_MEMORY if the ring was full and
+ *                 characters were dropped.
+ */
+int
+nighterm_ring_write(struct nighterm_ctx *context, const char *buf, size_t len)
+{
+  const uint32_t mask = NIGHTERM_RING_SIZE - 1;
+  uint8_t *data = (uint8_t *)context->ring;
+
+  while (len > 0) {
+    uint32_t chunk = len < NIGHTERM_RING_SIZE / 4 ? (uint32_t)len
+                                                  : NIGHTERM_RING_SIZE / 4;
+    uint32_t size = NIGHTERM_RING_RECORD(chunk);
+    uint32_t head = __atomic_load_n(&context->ring_head, __ATOMIC_RELAXED);
+    uint32_t pad;
+
+    /* Reserve: pad up to the end of the ring if the record would wrap. */
+    do {
+      uint32_t tail = __atomic_load_n(&context->ring_tail, __ATOMIC_ACQUIRE);
+      uint32_t offset = head & mask;
+      pad = offset + size > NIGHTERM_RING_SIZE ? NIGHTERM_RING_SIZE - offset
+                                                : 0;
+      if (head + pad + size - tail > NIGHTERM_RING_SIZE) {
+        __atomic_fetch_add(&context->ring_dropped, len, __ATOMIC_RELAXED);
+        return NIGHTERM_NO_MORE_MEMORY;
       }
-      // printc
-      context->cur_x++;
+    } while (!__atomic_compare_exchange_n(&context->ring_head,
+                                          &head,
+                                          head + pad + size,
+                                          1,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+
+    if (pad > 0) {
+      __atomic_store_n((uint32_t *)(data + (head & mask)),
+                       NIGHTERM_RING_COMMITTED | NIGHTERM_RING_PADDING |
+                         (pad - 4),
+                       __ATOMIC_RELEASE);
+      head += pad;
+    }
+
+    uint8_t *record = data + (head & mask);
+    nighterm_memcpy(record + 4, buf, chunk);
+    __atomic_store_n(
+      (uint32_t *)record, NIGHTERM_RING_COMMITTED | chunk, __ATOMIC_RELEASE);
+
+    buf += chunk;
+    len -= chunk;
+  }
+
+  return NIGHTERM_SUCCESS;
+}
+
+/**
+ * @brief Parses and draws everything queued by nighterm_ring_write(), then
+ *        flushes all damaged areas to the framebuffer at once.
+ *
+ * Only one CPU may drain at a time, and it should be the only one calling
+ * the other output functions. Draining stops at the first record that is
+ * still being written; the rest is left for the next call.
+ *
+ * @param          context
+ *                 Nighterm context
+ */
+void
+nighterm_drain(struct nighterm_ctx *context)
+{
+  const uint32_t mask = NIGHTERM_RING_SIZE - 1;
+  uint8_t *data = (uint8_t *)context->ring;
+  uint32_t tail = context->ring_tail;
+  uint32_t head = __atomic_load_n(&context->ring_head, __ATOMIC_ACQUIRE);
+
+  NIGHTERM_STAT_START(context);
+
+  while (tail != head) {
+    uint8_t *record = data + (tail & mask);
+    uint32_t header = __atomic_load_n((uint32_t *)record, __ATOMIC_ACQUIRE);
+    if (!(header & NIGHTERM_RING_COMMITTED)) {
       break;
+    }
+
+    uint32_t len = header & NIGHTERM_RING_LENGTH;
+    uint32_t size = NIGHTERM_RING_RECORD(len);
+    if (!(header & NIGHTERM_RING_PADDING)) {
+      nighterm_parse(context, (const char *)record + 4, len);
+    }
+
+    /* A later header may land anywhere in this record, so none of it may
+     * look committed once reused. */
+    nighterm_memset32(record, 0, size / 4);
+    tail += size;
+    __atomic_store_n(&context->ring_tail, tail, __ATOMIC_RELEASE);
   }
 
-  nighterm_flush_backbuffer(context);
+  NIGHTERM_STAT_STOP(context, parse_time);
+
+  nighterm_update(context);
 }
@@ -5,9 +5,15 @@
 #ifndef NIGHTERM_H
 #define NIGHTERM_H
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Define NIGHTERM_ENABLE_STATS to keep performance counters in the
+ *        context. Without it, the counters are compiled out.
+ */
+
 /**
  * @brief Amount of spaces a tab (or \t) represents.
  */
@@ -16,13 +22,168 @@
 #endif
 
 /**
- * @brief Default maximum framebuffer size if dynamic memory allocation
- *        is not available.
+ * @brief Framebuffer size the character grid is sized for if dynamic memory
+ *        allocation is not available. Larger framebuffers work, with the
+ *        text area limited to NIGHTERM_MAX_COLS by NIGHTERM_MAX_ROWS.
  */
 #ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+#ifndef NIGHTERM_MAX_FB_WIDTH
 #define NIGHTERM_MAX_FB_WIDTH 1920
+#endif
+#ifndef NIGHTERM_MAX_FB_HEIGHT
 #define NIGHTERM_MAX_FB_HEIGHT 1080
 #endif
+#endif
+
+/**
+ * @brief Maximum size of the character grid if dynamic memory allocation is
+ *        not available. Assumes glyphs are at least 8x8 pixels.
+ */
+#ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+#ifndef NIGHTERM_MAX_COLS
+#define NIGHTERM_MAX_COLS (NIGHTERM_MAX_FB_WIDTH / 8)
+#endif
+#ifndef NIGHTERM_MAX_ROWS
+#define NIGHTERM_MAX_ROWS (NIGHTERM_MAX_FB_HEIGHT / 8)
+#endif
+#define NIGHTERM_MAX_BANDS (NIGHTERM_MAX_ROWS + 1)
+#endif
+
+/**
+ * @brief Amount of expanded glyphs kept in the glyph cache.
+ *        Must be a power of two and a multiple of NIGHTERM_GLYPH_CACHE_WAYS.
+ */
+#ifndef NIGHTERM_GLYPH_CACHE_SIZE
+#define NIGHTERM_GLYPH_CACHE_SIZE 256
+#endif
+
+/**
+ * @brief Associativity of the glyph cache.
+ */
+#ifndef NIGHTERM_GLYPH_CACHE_WAYS
+#define NIGHTERM_GLYPH_CACHE_WAYS 4
+#endif
+
+/**
+ * @brief Largest supported glyph if dynamic memory allocation is not
+ *        available.
+ */
+#ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+#ifndef NIGHTERM_MAX_GLYPH_WIDTH
+#define NIGHTERM_MAX_GLYPH_WIDTH 16
+#endif
+#ifndef NIGHTERM_MAX_GLYPH_HEIGHT
+#define NIGHTERM_MAX_GLYPH_HEIGHT 32
+#endif
+#define NIGHTERM_MAX_GLYPH_BYTES                                              \
+  (NIGHTERM_MAX_GLYPH_WIDTH * NIGHTERM_MAX_GLYPH_HEIGHT * 4)
+#endif
+
+/**
+ * @brief Codepoints below this value are mapped to glyphs through a
+ *        direct-mapped table; the default covers all 1 and 2 byte UTF-8
+ *        sequences.
+ */
+#ifndef NIGHTERM_UNICODE_DIRECT
+#define NIGHTERM_UNICODE_DIRECT 0x800
+#endif
+
+/**
+ * @brief Capacity of the hash table for codepoints at or above
+ *        NIGHTERM_UNICODE_DIRECT. Must be a power of two.
+ */
+#ifndef NIGHTERM_UNICODE_OVERFLOW
+#define NIGHTERM_UNICODE_OVERFLOW 512
+#endif
+
+/**
+ * @brief Maximum amount of virtual terminals, including the one created by
+ *        nighterm_initialize().
+ */
+#ifndef NIGHTERM_MAX_TERMINALS
+#define NIGHTERM_MAX_TERMINALS 8
+#endif
+
+/**
+ * @brief Size of a terminal name, including the terminating NUL.
+ */
+#define NIGHTERM_TERMINAL_NAME_SIZE 16
+
+/**
+ * @brief Maximum amount of jobs a render is split into when the host
+ *        supplies run_jobs, and the least amount of changed rows per job.
+ */
+#ifndef NIGHTERM_RENDER_JOBS
+#define NIGHTERM_RENDER_JOBS 8
+#endif
+#ifndef NIGHTERM_RENDER_JOB_ROWS
+#define NIGHTERM_RENDER_JOB_ROWS 4
+#endif
+
+/**
+ * @brief Size of the scrollback arena of the console in bytes, see
+ *        nighterm_set_view(), if dynamic memory allocation is available.
+ *        Must be a power of two; the default keeps about 25000 typical
+ *        lines of 60 characters.
+ */
+#ifndef NIGHTERM_SCROLLBACK_SIZE
+#define NIGHTERM_SCROLLBACK_SIZE (2 * 1024 * 1024)
+#endif
+
+/**
+ * @brief Size of the multi-producer write ring in bytes, see
+ *        nighterm_ring_write(). Must be a power of two.
+ */
+#ifndef NIGHTERM_RING_SIZE
+#define NIGHTERM_RING_SIZE 65536
+#endif
+
+/**
+ * @brief Maximum amount of numeric parameters of an escape sequence; extra
+ *        parameters are dropped.
+ */
+#ifndef NIGHTERM_VT_MAX_PARAMS
+#define NIGHTERM_VT_MAX_PARAMS 16
+#endif
+
+/**
+ * @brief Amount of indexed colors selectable by SGR sequences: the 16 ANSI
+ *        colors, a 6x6x6 color cube and 24 shades of gray, as in xterm.
+ */
+#define NIGHTERM_PALETTE_SIZE 256
+
+/**
+ * @brief SGR color index meaning the default color.
+ */
+#define NIGHTERM_SGR_DEFAULT 0xFFFF
+
+/**
+ * @brief Flag of an SGR color that holds a 0xRRGGBB value instead of an
+ *        index.
+ */
+#define NIGHTERM_SGR_RGB 0x1000000
+
+/**
+ * @brief SGR attribute flags.
+ */
+#define NIGHTERM_SGR_BOLD 0x01
+#define NIGHTERM_SGR_REVERSE 0x02
+
+/**
+ * @brief Cursor flags.
+ */
+#define NIGHTERM_CURSOR_VISIBLE 0x01
+#define NIGHTERM_CURSOR_BLINK 0x02
+
+/**
+ * @brief PSF2 font magic number.
+ */
+#define NIGHTERM_PSF2_MAGIC 0x864AB572
+
+/**
+ * @brief PSF2 flag set if the font contains a Unicode table.
+ */
+#define NIGHTERM_PSF2_HAS_UNICODE_TABLE 0x01
 
 /**
  * @brief Memory allocator function pointer.
@@ -34,6 +195,323 @@ typedef void* (*nighterm_malloc)(size_t);
  */
 typedef void (*nighterm_free)(void*);
 
+/**
+ * @brief Fills count pixels with a packed color.
+ */
+typedef void (*nighterm_fill_span)(uint8_t *dest, uint32_t color, uint64_t count);
+
+/**
+ * @brief Expands one row of a 1bpp glyph bitmap into width pixels.
+ */
+typedef void (*nighterm_glyph_span)(uint8_t *dest,
+                                    const uint8_t *bitmap,
+                                    uint32_t width,
+                                    uint32_t fg,
+                                    uint32_t bg);
+
+/**
+ * @brief Job run by the host's run_jobs callback.
+ */
+typedef void (*nighterm_job)(void *arg, uint32_t index);
+
+/**
+ * @brief Where drawing happens before it reaches the framebuffer.
+ */
+enum nighterm_backbuffer_mode
+{
+  /* A backbuffer as large as the framebuffer. Without caller storage or a
+   * host allocator, falls back to NIGHTERM_BACKBUFFER_NONE. */
+  NIGHTERM_BACKBUFFER_FULL = 0,
+
+  /* A backbuffer covering only the text area, cols * cell_width by
+   * rows * cell_height pixels; the margins are filled straight into the
+   * framebuffer. */
+  NIGHTERM_BACKBUFFER_TEXT = 1,
+
+  /* No backbuffer: glyphs are drawn straight into the framebuffer, and
+   * scrolling redraws the grid unless the host can pan. Does not work with
+   * page flipping. */
+  NIGHTERM_BACKBUFFER_NONE = 2
+};
+
+/**
+ * @brief Optional host callbacks and settings. Unused callbacks must be
+ *        NULL.
+ */
+struct nighterm_hooks
+{
+  /* Passed to every callback. */
+  void *user;
+
+  /*
+   * Panning: if set_scanout_offset is set and the framebuffer memory is
+   * taller than the visible mode, scrolling moves the scanout start down
+   * by one row of cells instead of rewriting the whole screen.
+   * scanout_height is the amount of scanlines of framebuffer memory.
+   */
+  uint64_t scanout_height;
+  int (*set_scanout_offset)(void *user, uint64_t y);
+
+  /*
+   * Page flipping: called after a frame has been written to the page at
+   * the current framebuffer address. The host shows that page and returns
+   * the address of the page that receives the next frame. Takes precedence
+   * over panning.
+   */
+  void *(*flip_page)(void *user);
+
+  /*
+   * Monotonic clock, ticking clock_hz times per second. Used to time each
+   * stage for statistics; if NULL, the time stamp counter is used on x86
+   * and stages are not timed elsewhere. Also paces nighterm_present() if
+   * clock_hz is set.
+   */
+  uint64_t (*clock)(void *user);
+  uint64_t clock_hz;
+
+  /*
+   * Parallel rendering: runs job(arg, index) for every index below count,
+   * in any order and on any CPUs, and returns once all of them finished.
+   * Jobs touch disjoint memory and take no locks. If NULL, or if only a
+   * few rows changed, rendering stays on the calling CPU.
+   */
+  void (*run_jobs)(void *user, nighterm_job job, void *arg, uint32_t count);
+
+  /*
+   * Backbuffer: the mode, and optionally backbuffer_size bytes of storage
+   * for it. A full backbuffer needs width * height * bytes per pixel; a
+   * text area backbuffer needs at most as much. Without storage, the
+   * backbuffer is allocated from the host allocator.
+   */
+  enum nighterm_backbuffer_mode backbuffer_mode;
+  void *backbuffer;
+  uint64_t backbuffer_size;
+
+  /*
+   * Storage used without NIGHTERM_MALLOC_IS_AVAILABLE, ignored otherwise.
+   * terminal_storage holds the character grids of terminals created by
+   * nighterm_create_terminal(), NIGHTERM_TERMINAL_SIZE() bytes each;
+   * scrollback holds the scrollback of the console, of which the largest
+   * power of two that fits is used. Without them, only the console can
+   * exist and it keeps no scrollback.
+   */
+  void *terminal_storage;
+  uint64_t terminal_storage_size;
+  void *scrollback;
+  uint64_t scrollback_size;
+};
+
+/**
+ * @brief When writes reach the framebuffer.
+ */
+enum nighterm_present_mode
+{
+  /* Every write is drawn and flushed before it returns. */
+  NIGHTERM_PRESENT_IMMEDIATE = 0,
+
+  /* Writes only update the character grid; nighterm_present() draws and
+   * flushes everything accumulated since the last frame. */
+  NIGHTERM_PRESENT_DEFERRED = 1
+};
+
+/**
+ * @brief Shape of the cursor, drawn over the cell under it.
+ */
+enum nighterm_cursor_style
+{
+  /* The cell in reverse colors. */
+  NIGHTERM_CURSOR_BLOCK = 0,
+
+  /* A line along the bottom of the cell, in its foreground color. */
+  NIGHTERM_CURSOR_UNDERLINE = 1,
+
+  /* A line along the left edge of the cell, in its foreground color. */
+  NIGHTERM_CURSOR_BAR = 2
+};
+
+/**
+ * @brief Attributes of text drawn by nighterm_draw_text_at().
+ *
+ * Colors are given as in SGR sequences: an index into the palette,
+ * NIGHTERM_SGR_RGB | 0xRRGGBB, or NIGHTERM_SGR_DEFAULT for the default
+ * color of the terminal.
+ */
+struct nighterm_attr
+{
+  uint32_t fg;
+  uint32_t bg;
+  /* NIGHTERM_SGR_BOLD and NIGHTERM_SGR_REVERSE. */
+  uint8_t flags;
+};
+
+/**
+ * @brief Performance counters, see nighterm_get_stats().
+ *
+ * Stage times are in units of the hooks' clock, or in TSC ticks.
+ */
+struct nighterm_stats
+{
+  uint64_t chars_written;
+  uint64_t glyphs_rasterized;
+  uint64_t glyph_cache_hits;
+  uint64_t glyph_cache_misses;
+  uint64_t flushes;
+  uint64_t vram_bytes;
+  uint64_t scrolls;
+  uint64_t ring_dropped;
+
+  uint64_t parse_time;
+  uint64_t render_time;
+  uint64_t flush_time;
+};
+
+/**
+ * @brief Damaged horizontal span of a band of scanlines, in pixels.
+ *
+ * The span is empty if x0 >= x1.
+ */
+struct nighterm_span
+{
+  uint32_t x0;
+  uint32_t x1;
+};
+
+/**
+ * @brief PSF2 font header.
+ */
+struct nighterm_psf2_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headersize;
+  uint32_t flags;
+  uint32_t numglyph;
+  uint32_t bytesperglyph;
+  uint32_t height;
+  uint32_t width;
+};
+
+/**
+ * @brief Codepoint to glyph mapping outside of the direct-mapped range.
+ */
+struct nighterm_unicode_entry
+{
+  uint32_t codepoint;
+  uint32_t glyph;
+};
+
+/**
+ * @brief A single character cell: 12 bytes.
+ *
+ * Colors are packed in the framebuffer's pixel format.
+ */
+struct nighterm_cell
+{
+  uint32_t codepoint;
+  uint32_t fg;
+  uint32_t bg;
+};
+
+/**
+ * @brief Bytes of terminal_storage taken by the character grid of a
+ *        terminal on a width by height framebuffer, if dynamic memory
+ *        allocation is not available.
+ */
+#ifndef NIGHTERM_MALLOC_IS_AVAILABLE
+#define NIGHTERM_TERMINAL_SIZE(width, height)                                 \
+  ((uint64_t)((width) / 8 < NIGHTERM_MAX_COLS ? (width) / 8                    \
+                                              : NIGHTERM_MAX_COLS) *           \
+   ((height) / 8 < NIGHTERM_MAX_ROWS ? (height) / 8 : NIGHTERM_MAX_ROWS) *     \
+   sizeof(struct nighterm_cell))
+#endif
+
+/**
+ * @brief Glyph cache slot: a glyph expanded for a fg/bg color pair.
+ */
+struct nighterm_glyph_slot
+{
+  uint32_t glyph;
+  uint32_t fg;
+  uint32_t bg;
+  uint32_t last_used;
+};
+
+/**
+ * @brief Scrollback of a terminal: lines that scrolled off the top, kept
+ *        in a byte ring of mask + 1 bytes and evicted oldest first.
+ *
+ * Each line is one record:
+ *
+ *   u16 length, u8 flags, u16 chars, u16 runs,
+ *   runs * { u16 count, u32 fg, u32 bg },
+ *   chars * 1 byte (ASCII) or 3 bytes (NIGHTERM_HISTORY_WIDE),
+ *   u16 length
+ *
+ * Trailing blanks are not stored; the last run's colors fill the rest of
+ * the line. The trailing length lets records be walked backwards.
+ */
+struct nighterm_history
+{
+  uint8_t *data;
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t used;
+  uint32_t lines;
+
+  /* Lines scrolled back from the live screen, and the record shown on the
+   * top row; view_top equals head while the view is live. */
+  uint32_t view;
+  uint32_t view_top;
+};
+
+/**
+ * @brief Virtual terminal.
+ *
+ * The state of the active terminal lives in the context; the record of a
+ * background terminal holds its state, with its character grid as the only
+ * large part. Fields below name mirror the context fields of the same name.
+ */
+struct nighterm_terminal
+{
+  char name[NIGHTERM_TERMINAL_NAME_SIZE];
+  uint8_t used;
+
+  void *font;
+  uint64_t font_size;
+  struct nighterm_cell *cells;
+  uint32_t row_origin;
+  struct nighterm_history history;
+
+  uint32_t cur_x;
+  uint32_t cur_y;
+  uint32_t saved_x;
+  uint32_t saved_y;
+  uint32_t scroll_top;
+  uint32_t scroll_bottom;
+  uint8_t cursor_style;
+  uint8_t cursor_flags;
+
+  uint8_t vt_state;
+  uint8_t vt_private;
+  uint8_t vt_intermediate;
+  uint8_t vt_param_count;
+  uint16_t vt_params[NIGHTERM_VT_MAX_PARAMS];
+
+  uint32_t utf8_codepoint;
+  uint8_t utf8_length;
+  uint8_t utf8_remaining;
+
+  uint32_t default_fg;
+  uint32_t default_bg;
+  uint32_t sgr_fg;
+  uint32_t sgr_bg;
+  uint8_t sgr_flags;
+
+  uint32_t fg_color;
+  uint32_t bg_color;
+};
+
 /**
  * @brief Nighterm Terminal object.
  */
@@ -44,17 +522,140 @@ struct nighterm_ctx
   uint64_t fb_height;
   uint64_t fb_bpp;
   uint64_t fb_pitch;
+  uint64_t fb_bytes_per_pixel;
 
-#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  /* Pixel layout, and blitters specialized for it. */
+  uint8_t red_size;
+  uint8_t red_shift;
+  uint8_t green_size;
+  uint8_t green_shift;
+  uint8_t blue_size;
+  uint8_t blue_shift;
+  nighterm_fill_span fill_span;
+  nighterm_glyph_span glyph_span;
+
+  /* Backbuffer covering backbuffer_width by backbuffer_height pixels, or
+   * NULL; owned if it came from the host allocator. The margins outside
+   * of the text area have border_color. */
+  enum nighterm_backbuffer_mode backbuffer_mode;
   uint8_t *backbuffer;
+  uint64_t backbuffer_size;
+  uint64_t backbuffer_pitch;
+  uint64_t backbuffer_width;
+  uint64_t backbuffer_height;
+  uint8_t backbuffer_owned;
+  uint32_t border_color;
+
+  struct nighterm_psf2_header font_header;
+  void* font;
+  uint64_t font_size;
+  void* font_data;
+
+  /* Codepoint to glyph index, built from the font's Unicode table. */
+  uint16_t unicode_direct[NIGHTERM_UNICODE_DIRECT];
+  struct nighterm_unicode_entry unicode_overflow[NIGHTERM_UNICODE_OVERFLOW];
+  uint32_t unicode_fallback;
+
+  uint32_t cell_width;
+  uint32_t cell_height;
+
+  /* One damage span per band of cell_height scanlines. */
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  struct nighterm_span *damage;
 #else
-  uint8_t backbuffer[NIGHTERM_MAX_FB_WIDTH * NIGHTERM_MAX_FB_HEIGHT * 4];
+  struct nighterm_span damage[NIGHTERM_MAX_BANDS];
 #endif
+  uint32_t bands;
+  uint32_t damage_first;
+  uint32_t damage_last;
 
-  void* font_data;
+  /* Damage of the previous frame, still missing from the back page. */
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  struct nighterm_span *flip_damage;
+#else
+  struct nighterm_span flip_damage[NIGHTERM_MAX_BANDS];
+#endif
+
+  struct nighterm_hooks hooks;
+  uint64_t pan_y;
+  uint64_t scanout_y;
+
+  /* Presentation mode and frame pacing, in clock ticks. */
+  uint8_t present_mode;
+  uint64_t frame_interval;
+  uint64_t last_present;
+
+#ifdef NIGHTERM_ENABLE_STATS
+  struct nighterm_stats stats;
+#endif
+
+  /* Glyphs pre-expanded into the framebuffer's pixel format. */
+  struct nighterm_glyph_slot glyph_slots[NIGHTERM_GLYPH_CACHE_SIZE];
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  uint8_t *glyph_pixels;
+#else
+  uint8_t glyph_pixels[NIGHTERM_GLYPH_CACHE_SIZE * NIGHTERM_MAX_GLYPH_BYTES];
+#endif
+  uint32_t glyph_tick;
+
+  /* Character grid, the source of truth for the text area. */
+  struct nighterm_cell *cells;
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  struct nighterm_span *dirty;
+#else
+  /* The console's grid; other terminals take slots of
+   * NIGHTERM_TERMINAL_SIZE() bytes from hooks.terminal_storage. */
+  struct nighterm_cell cell_storage[NIGHTERM_MAX_COLS * NIGHTERM_MAX_ROWS];
+  struct nighterm_span dirty[NIGHTERM_MAX_ROWS];
+#endif
+  uint32_t dirty_first;
+  uint32_t dirty_last;
+
+  /* Physical row of the top screen row in the grid and the backbuffer. */
+  uint32_t row_origin;
+
+  /* Scrollback; only the console has an arena, data is NULL otherwise. */
+  struct nighterm_history history;
+
+  uint32_t cur_x;
+  uint32_t cur_y;
+  uint32_t saved_x;
+  uint32_t saved_y;
+
+  /* Scroll region set by DECSTBM: rows scroll_top to scroll_bottom - 1. */
+  uint32_t scroll_top;
+  uint32_t scroll_bottom;
+
+  /*
+   * Cursor overlay. The cell it is drawn over is kept as a physical row,
+   * which its pixels stay in while the rings rotate.
+   */
+  uint8_t cursor_style;
+  uint8_t cursor_flags;
+  uint8_t cursor_drawn;
+  uint8_t cursor_blink_off;
+  uint32_t cursor_row;
+  uint32_t cursor_col;
+
+  /* Escape sequence parser state. */
+  uint8_t vt_state;
+  uint8_t vt_private;
+  uint8_t vt_intermediate;
+  uint8_t vt_param_count;
+  uint16_t vt_params[NIGHTERM_VT_MAX_PARAMS];
+
+  /* Partially decoded UTF-8 sequence, possibly split across writes. */
+  uint32_t utf8_codepoint;
+  uint8_t utf8_length;
+  uint8_t utf8_remaining;
 
-  uint8_t cur_x;
-  uint8_t cur_y;
+  /* Graphic rendition; fg_color and bg_color are derived from it. */
+  uint32_t palette[NIGHTERM_PALETTE_SIZE];
+  uint32_t default_fg;
+  uint32_t default_bg;
+  uint32_t sgr_fg;
+  uint32_t sgr_bg;
+  uint8_t sgr_flags;
 
   uint32_t rows;
   uint32_t cols;
@@ -62,6 +663,25 @@ struct nighterm_ctx
   uint32_t fg_color;
   uint32_t bg_color;
 
+  /* Virtual terminals; background is set while writing to one of them. */
+  struct nighterm_terminal terminals[NIGHTERM_MAX_TERMINALS];
+  uint32_t active_terminal;
+  uint8_t background;
+
+  /*
+   * Write ring: any CPU reserves space by advancing ring_head and commits
+   * by setting a record header; nighterm_drain() consumes records from
+   * ring_tail. The indices run freely and are masked on access.
+   */
+#ifdef NIGHTERM_MALLOC_IS_AVAILABLE
+  uint32_t *ring;
+#else
+  uint32_t ring[NIGHTERM_RING_SIZE / 4];
+#endif
+  uint32_t ring_head __attribute__((aligned(64)));
+  uint32_t ring_tail __attribute__((aligned(64)));
+  uint32_t ring_dropped;
+
   nighterm_malloc malloc;
   nighterm_free free;
 };
@@ -83,27 +703,86 @@ enum nighterm_status
 int
 nighterm_initialize(struct nighterm_ctx *new,
                     void* font,
+                    uint64_t font_size,
                     void* framebuffer_addr,
                     uint64_t framebuffer_width,
                     uint64_t framebuffer_height,
                     uint16_t framebuffer_bpp,
                     nighterm_malloc custom_malloc,
-                    nighterm_free custom_free);
+                    nighterm_free custom_free,
+                    const struct nighterm_hooks *hooks);
 int
 nighterm_shutdown(struct nighterm_ctx *context);
 
 int
-nighterm_create_terminal(char* name, char* font, uint8_t should_switch);
-void
-nighterm_switch_terminal(int id);
+nighterm_create_terminal(struct nighterm_ctx *context,
+                         const char *name,
+                         void *font,
+                         uint64_t font_size,
+                         uint8_t should_switch);
+int
+nighterm_switch_terminal(struct nighterm_ctx *context, int id);
+int
+nighterm_write_terminal(struct nighterm_ctx *context,
+                        int id,
+                        const char *buf,
+                        size_t len);
 
 int
-nighterm_set_font(struct nighterm_ctx *context, void *font);
+nighterm_set_font(struct nighterm_ctx *context, void *font, uint64_t font_size);
 
 void
 nighterm_write(struct nighterm_ctx *context, char c);
 void
+nighterm_write_buffer(struct nighterm_ctx *context, const char *buf, size_t len);
+void
+nighterm_printf(struct nighterm_ctx *context, const char *fmt, ...);
+void
+nighterm_vprintf(struct nighterm_ctx *context, const char *fmt, va_list args);
+void
 nighterm_flush(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b);
+int
+nighterm_draw_text_at(struct nighterm_ctx *context,
+                      uint32_t col,
+                      uint32_t row,
+                      const char *text,
+                      size_t len,
+                      const struct nighterm_attr *attr);
+
+int
+nighterm_set_present_mode(struct nighterm_ctx *context,
+                          enum nighterm_present_mode mode,
+                          uint32_t max_fps);
+int
+nighterm_present(struct nighterm_ctx *context);
+
+int
+nighterm_ring_write(struct nighterm_ctx *context, const char *buf, size_t len);
+void
+nighterm_drain(struct nighterm_ctx *context);
+
+int
+nighterm_set_view(struct nighterm_ctx *context, uint32_t lines);
+int
+nighterm_scroll_view(struct nighterm_ctx *context, int32_t lines);
+void
+nighterm_get_view(struct nighterm_ctx *context,
+                  uint32_t *view,
+                  uint32_t *lines);
+
+int
+nighterm_set_pixel_format(struct nighterm_ctx *context,
+                          uint8_t red_size,
+                          uint8_t red_shift,
+                          uint8_t green_size,
+                          uint8_t green_shift,
+                          uint8_t blue_size,
+                          uint8_t blue_shift);
+
+int
+nighterm_get_stats(struct nighterm_ctx *context, struct nighterm_stats *stats);
+void
+nighterm_reset_stats(struct nighterm_ctx *context);
 
 void
 nighterm_set_fg_color(struct nighterm_ctx *context, uint8_t r, uint8_t g, uint8_t b);
@@ -116,5 +795,13 @@ void
 nighterm_set_cursor_position(struct nighterm_ctx *context, uint32_t x, uint32_t y);
 void
 nighterm_get_cursor_position(struct nighterm_ctx *context, uint32_t* x, uint32_t* y);
+int
+nighterm_set_cursor_style(struct nighterm_ctx *context,
+                          enum nighterm_cursor_style style,
+                          uint8_t blink);
+void
+nighterm_set_cursor_visible(struct nighterm_ctx *context, uint8_t visible);
+void
+nighterm_blink_cursor(struct nighterm_ctx *context);
 
 #endif // NIGHTERM_H